@@ -0,0 +1,61 @@
+#include "alloc_counter.hpp"
+
+#include <cstdlib>
+#include <new>
+
+static long allocation_count = 0;
+
+long AllocCounter::allocations() { return allocation_count; }
+
+#ifdef LOX_COUNT_ALLOCS
+
+bool AllocCounter::supported() { return true; }
+
+static void *counted_alloc(std::size_t size) {
+  allocation_count++;
+  void *mem = std::malloc(size == 0 ? 1 : size);
+  if (mem == nullptr) {
+    throw std::bad_alloc{};
+  }
+  return mem;
+}
+
+static void *counted_alloc(std::size_t size, std::align_val_t align) {
+  allocation_count++;
+  std::size_t alignment = static_cast<std::size_t>(align);
+  // aligned_alloc wants a multiple of the alignment
+  void *mem = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+  if (mem == nullptr) {
+    throw std::bad_alloc{};
+  }
+  return mem;
+}
+
+void *operator new(std::size_t size) { return counted_alloc(size); }
+void *operator new[](std::size_t size) { return counted_alloc(size); }
+void *operator new(std::size_t size, std::align_val_t align) { return counted_alloc(size, align); }
+void *operator new[](std::size_t size, std::align_val_t align) { return counted_alloc(size, align); }
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  allocation_count++;
+  return std::malloc(size == 0 ? 1 : size);
+}
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  allocation_count++;
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+void operator delete(void *mem) noexcept { std::free(mem); }
+void operator delete[](void *mem) noexcept { std::free(mem); }
+void operator delete(void *mem, std::size_t) noexcept { std::free(mem); }
+void operator delete[](void *mem, std::size_t) noexcept { std::free(mem); }
+void operator delete(void *mem, std::align_val_t) noexcept { std::free(mem); }
+void operator delete[](void *mem, std::align_val_t) noexcept { std::free(mem); }
+void operator delete(void *mem, std::size_t, std::align_val_t) noexcept { std::free(mem); }
+void operator delete[](void *mem, std::size_t, std::align_val_t) noexcept { std::free(mem); }
+
+#else
+
+bool AllocCounter::supported() { return false; }
+
+#endif // LOX_COUNT_ALLOCS
@@ -0,0 +1,23 @@
+#ifndef ALLOC_COUNTER_H_
+#define ALLOC_COUNTER_H_
+
+/* Counts the heap allocations the interpreter makes, for checking that a
+ * piece of Lox code doesn't allocate (jlox --count-allocs, which gives
+ * scripts an "allocations()" native to read the count before and after a
+ * loop).
+ *
+ * The count is kept by replacing the global operator new, so it covers
+ * every C++ allocation (strings, environments, vectors, ...) but not
+ * malloc calls made outside of it. Replacing it would also hide new/delete
+ * mismatches from ASAN, so it's only done in builds made with
+ * -DLOX_COUNT_ALLOCS (make count-allocs). Other builds keep the default
+ * allocator and can't count. */
+class AllocCounter {
+public:
+  // Whether this build counts allocations
+  static bool supported();
+  // The number of operator new calls since the program started
+  static long allocations();
+};
+
+#endif // ALLOC_COUNTER_H_
@@ -0,0 +1,436 @@
+#include "batch.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <unordered_map>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "../util.hpp"
+#include "lox_function.hpp"
+
+// Rows per chunk: enough to amortize the per-node dispatch, few enough for
+// the columns of a function to stay in cache
+constexpr size_t BATCH_CHUNK = 1024;
+
+// Thrown when the function (or a chunk of it) can't be run vectorized
+class NotVectorizable : public std::exception {};
+
+enum BatchTy { BATCH_NUM, BATCH_BOOL };
+
+// The value of a node over a whole chunk, booleans as 0.0/1.0
+struct Column {
+  BatchTy ty;
+  std::vector<double> v;
+};
+
+// Lanes that run the code at hand are 1.0, the others 0.0
+using Mask = std::vector<double>;
+
+/* Kernels, two lanes at a time with SSE2. Comparisons produce 0.0/1.0 and
+ * use the same NaN semantics as the C++ operators the interpreter uses. Since
+ * 0.0 and 1.0 only differ in the exponent bits, and/or/not on booleans are
+ * plain bitwise operations */
+#if defined(__SSE2__)
+#define BATCH_VECTOR(expr) \
+  static __m128d vector(__m128d a, __m128d b) { return expr; }
+static inline __m128d ones() { return _mm_set1_pd(1.0); }
+#else
+#define BATCH_VECTOR(expr)
+#endif
+
+struct AddOp {
+  static double scalar(double a, double b) { return a + b; }
+  BATCH_VECTOR(_mm_add_pd(a, b))
+};
+struct SubOp {
+  static double scalar(double a, double b) { return a - b; }
+  BATCH_VECTOR(_mm_sub_pd(a, b))
+};
+struct MulOp {
+  static double scalar(double a, double b) { return a * b; }
+  BATCH_VECTOR(_mm_mul_pd(a, b))
+};
+struct DivOp {
+  static double scalar(double a, double b) { return a / b; }
+  BATCH_VECTOR(_mm_div_pd(a, b))
+};
+struct LessOp {
+  static double scalar(double a, double b) { return a < b; }
+  BATCH_VECTOR(_mm_and_pd(_mm_cmplt_pd(a, b), ones()))
+};
+struct LessEqualOp {
+  static double scalar(double a, double b) { return a <= b; }
+  BATCH_VECTOR(_mm_and_pd(_mm_cmple_pd(a, b), ones()))
+};
+struct GreaterOp {
+  static double scalar(double a, double b) { return a > b; }
+  BATCH_VECTOR(_mm_and_pd(_mm_cmpgt_pd(a, b), ones()))
+};
+struct GreaterEqualOp {
+  static double scalar(double a, double b) { return a >= b; }
+  BATCH_VECTOR(_mm_and_pd(_mm_cmpge_pd(a, b), ones()))
+};
+struct EqualOp {
+  static double scalar(double a, double b) { return a == b; }
+  BATCH_VECTOR(_mm_and_pd(_mm_cmpeq_pd(a, b), ones()))
+};
+struct NotEqualOp {
+  static double scalar(double a, double b) { return a != b; }
+  BATCH_VECTOR(_mm_and_pd(_mm_cmpneq_pd(a, b), ones()))
+};
+struct AndOp {
+  static double scalar(double a, double b) { return a != 0 && b != 0; }
+  BATCH_VECTOR(_mm_and_pd(a, b))
+};
+struct OrOp {
+  static double scalar(double a, double b) { return a != 0 || b != 0; }
+  BATCH_VECTOR(_mm_or_pd(a, b))
+};
+struct AndNotOp {
+  static double scalar(double a, double b) { return a != 0 && b == 0; }
+  BATCH_VECTOR(_mm_andnot_pd(b, a))
+};
+
+template <class Op>
+static void kernel(const double *a, const double *b, double *out, size_t n) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 2 <= n; i += 2) {
+    _mm_storeu_pd(out + i, Op::vector(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = Op::scalar(a[i], b[i]);
+  }
+}
+
+template <class Op>
+static std::vector<double> apply(const std::vector<double> &a, const std::vector<double> &b) {
+  std::vector<double> out(a.size());
+  kernel<Op>(a.data(), b.data(), out.data(), a.size());
+  return out;
+}
+
+// "into" takes the value of "from" in the lanes of "mask"
+static void select(const Mask &mask, const std::vector<double> &from, std::vector<double> &into) {
+  size_t i = 0;
+  size_t n = mask.size();
+#if defined(__SSE2__)
+  for (; i + 2 <= n; i += 2) {
+    __m128d m = _mm_cmpneq_pd(_mm_loadu_pd(mask.data() + i), _mm_setzero_pd());
+    __m128d v = _mm_or_pd(_mm_and_pd(m, _mm_loadu_pd(from.data() + i)),
+                          _mm_andnot_pd(m, _mm_loadu_pd(into.data() + i)));
+    _mm_storeu_pd(into.data() + i, v);
+  }
+#endif
+  for (; i < n; i++) {
+    if (mask[i] != 0) {
+      into[i] = from[i];
+    }
+  }
+}
+
+static bool any(const Mask &mask) {
+  for (double lane : mask) {
+    if (lane != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+enum LaneResult { LANE_NIL, LANE_NUM, LANE_BOOL, LANE_INTERPRET };
+
+/* Runs the body of a function over one chunk. "alive" are the lanes that
+ * haven't returned yet (or been handed over to the interpreter), every
+ * statement runs under its mask and'ed with it */
+class ChunkRunner {
+private:
+  const FuncStmt *decl;
+  size_t n;
+  Mask alive;
+  std::vector<std::unordered_map<std::string, Column>> scopes;
+
+  Column *lookup(const std::string &name) {
+    // The interpreter looks at the globals first, even over parameters
+    if (name == "clock") {
+      throw NotVectorizable{};
+    }
+    for (auto it = this->scopes.rbegin(); it != this->scopes.rend(); it++) {
+      auto found = it->find(name);
+      if (found != it->end()) {
+        return &found->second;
+      }
+    }
+    // Globals, the function itself and anything else isn't vectorized
+    throw NotVectorizable{};
+  }
+
+  Column typed(const Expr &expr, const Mask &mask, BatchTy ty) {
+    Column col = this->expr(expr, mask);
+    if (col.ty != ty) {
+      throw NotVectorizable{};
+    }
+    return col;
+  }
+
+  Column binary(const BinaryExpr &binary, const Mask &mask) {
+    auto a = typed(*binary.left, mask, BatchTy::BATCH_NUM).v;
+    auto b = typed(*binary.right, mask, BatchTy::BATCH_NUM).v;
+    switch (binary.op.type) {
+      case TokenType::PLUS: return Column{BatchTy::BATCH_NUM, apply<AddOp>(a, b)};
+      case TokenType::MINUS: return Column{BatchTy::BATCH_NUM, apply<SubOp>(a, b)};
+      case TokenType::STAR: return Column{BatchTy::BATCH_NUM, apply<MulOp>(a, b)};
+      case TokenType::SLASH:
+        // Rows dividing by zero go to the interpreter, which reports it
+        for (size_t i = 0; i < this->n; i++) {
+          if (mask[i] != 0 && b[i] == 0.0) {
+            retire(i, LaneResult::LANE_INTERPRET);
+          }
+        }
+        return Column{BatchTy::BATCH_NUM, apply<DivOp>(a, b)};
+      case TokenType::LESS: return Column{BatchTy::BATCH_BOOL, apply<LessOp>(a, b)};
+      case TokenType::LESS_EQUAL: return Column{BatchTy::BATCH_BOOL, apply<LessEqualOp>(a, b)};
+      case TokenType::GREATER: return Column{BatchTy::BATCH_BOOL, apply<GreaterOp>(a, b)};
+      case TokenType::GREATER_EQUAL:
+        return Column{BatchTy::BATCH_BOOL, apply<GreaterEqualOp>(a, b)};
+      case TokenType::EQUAL_EQUAL: return Column{BatchTy::BATCH_BOOL, apply<EqualOp>(a, b)};
+      case TokenType::BANG_EQUAL: return Column{BatchTy::BATCH_BOOL, apply<NotEqualOp>(a, b)};
+      default:
+        throw NotVectorizable{};
+    }
+  }
+
+  Column logical(const LogicalExpr &logical, const Mask &mask) {
+    Column left = typed(*logical.left, mask, BatchTy::BATCH_BOOL);
+    bool is_or = logical.op.type == TokenType::OR;
+    // Only the lanes that don't short-circuit evaluate the right side
+    Mask rest = is_or ? apply<AndNotOp>(mask, left.v) : apply<AndOp>(mask, left.v);
+    if (!any(rest)) {
+      return left;
+    }
+    Column right = typed(*logical.right, rest, BatchTy::BATCH_BOOL);
+    select(rest, right.v, left.v);
+    return left;
+  }
+
+  Column expr(const Expr &expr, const Mask &mask) {
+    switch (expr.ty) {
+      case ExprTy::LITERAL:
+        if (expr.lit.lit.ty == LiteralTy::LIT_NUMBER) {
+          return Column{BatchTy::BATCH_NUM, std::vector<double>(this->n, expr.lit.lit.number)};
+        }
+        if (expr.lit.lit.ty == LiteralTy::LIT_BOOL) {
+          return Column{BatchTy::BATCH_BOOL, std::vector<double>(this->n, expr.lit.lit.lox_bool ? 1.0 : 0.0)};
+        }
+        throw NotVectorizable{};
+      case ExprTy::GROUPING:
+        return this->expr(*expr.group.expression, mask);
+      case ExprTy::VAR_EXPR:
+        return *lookup(expr.var_expr.name.lexeme);
+      case ExprTy::ASSIGN_EXPR: {
+        Column value = this->expr(*expr.ass_expr.value, mask);
+        Column *var = lookup(expr.ass_expr.name.lexeme);
+        if (var->ty != value.ty) {
+          throw NotVectorizable{};
+        }
+        select(active(mask), value.v, var->v);
+        return value;
+      }
+      case ExprTy::UNARY:
+        if (expr.unary.op.type == TokenType::MINUS) {
+          Column col = typed(*expr.unary.right, mask, BatchTy::BATCH_NUM);
+          for (auto &lane : col.v) {
+            lane = -lane;
+          }
+          return col;
+        } else {
+          Column col = typed(*expr.unary.right, mask, BatchTy::BATCH_BOOL);
+          std::vector<double> one(this->n, 1.0);
+          col.v = apply<AndNotOp>(one, col.v);
+          return col;
+        }
+      case ExprTy::BINARY:
+        return binary(expr.bin, mask);
+      case ExprTy::LOGICAL_EXPR:
+        return logical(expr.logical, mask);
+      default:
+        throw NotVectorizable{};
+    }
+  }
+
+  Mask active(const Mask &mask) { return apply<AndOp>(mask, this->alive); }
+
+  void retire(size_t lane, LaneResult how) {
+    if (this->alive[lane] != 0) {
+      this->alive[lane] = 0;
+      this->result_ty[lane] = how;
+    }
+  }
+
+  void block(const std::vector<Stmt> &statements, const Mask &mask) {
+    this->scopes.emplace_back();
+    for (auto &st : statements) {
+      this->stmt(st, mask);
+    }
+    this->scopes.pop_back();
+  }
+
+  void stmt(const Stmt &stmt, const Mask &outer) {
+    Mask mask = active(outer);
+    if (!any(mask)) {
+      return;
+    }
+    switch (stmt.ty) {
+      case StmtTy::STMT_EXPR:
+        expr(stmt.expression.expr, mask);
+        break;
+      case StmtTy::STMT_VAR:
+        if (stmt.var.initializer.is_nil()) {
+          throw NotVectorizable{};
+        }
+        this->scopes.back()[stmt.var.name.lexeme] = expr(stmt.var.initializer, mask);
+        break;
+      case StmtTy::STMT_BLOCK:
+        block(stmt.block.statements, mask);
+        break;
+      case StmtTy::STMT_IF: {
+        Column cond = expr(stmt.if_stmt.condition, mask);
+        if (cond.ty == BatchTy::BATCH_NUM) {
+          // Numbers are always truthy
+          this->stmt(*stmt.if_stmt.then_branch, mask);
+          break;
+        }
+        Mask else_mask = apply<AndNotOp>(mask, cond.v);
+        this->stmt(*stmt.if_stmt.then_branch, apply<AndOp>(mask, cond.v));
+        if (stmt.if_stmt.else_branch != nullptr) {
+          this->stmt(*stmt.if_stmt.else_branch, else_mask);
+        }
+        break;
+      }
+      case StmtTy::STMT_WHILE: {
+        Mask looping = mask;
+        while (true) {
+          looping = active(looping);
+          if (!any(looping)) {
+            break;
+          }
+          Column cond = expr(stmt.while_stmt.cond, looping);
+          if (cond.ty == BatchTy::BATCH_BOOL) {
+            looping = apply<AndOp>(looping, cond.v);
+          }
+          this->stmt(*stmt.while_stmt.body, looping);
+        }
+        break;
+      }
+      case StmtTy::STMT_RETURN: {
+        if (stmt.return_stmt.value.is_nil()) {
+          for (size_t i = 0; i < this->n; i++) {
+            if (mask[i] != 0) {
+              retire(i, LaneResult::LANE_NIL);
+            }
+          }
+          break;
+        }
+        Column value = expr(stmt.return_stmt.value, mask);
+        // Evaluating the value may have retired lanes (division by zero)
+        mask = active(mask);
+        select(mask, value.v, this->result);
+        for (size_t i = 0; i < this->n; i++) {
+          if (mask[i] != 0) {
+            retire(i, value.ty == BatchTy::BATCH_NUM ? LaneResult::LANE_NUM : LaneResult::LANE_BOOL);
+          }
+        }
+        break;
+      }
+      default:
+        throw NotVectorizable{};
+    }
+  }
+
+public:
+  std::vector<double> result;
+  std::vector<LaneResult> result_ty;
+
+  ChunkRunner(const FuncStmt *decl, size_t n)
+      : decl(decl), n(n), alive(n, 1.0), result(n, 0.0), result_ty(n, LaneResult::LANE_NIL) {}
+
+  void run(const std::vector<std::vector<double>> &columns, size_t first) {
+    this->scopes.emplace_back();
+    for (size_t p = 0; p < this->decl->params.size(); p++) {
+      auto begin = columns[p].begin() + first;
+      this->scopes.back()[this->decl->params[p].lexeme] =
+          Column{BatchTy::BATCH_NUM, std::vector<double>(begin, begin + this->n)};
+    }
+    block(this->decl->body.statements, this->alive);
+    // Lanes still alive fell off the end of the body, they return nil
+  }
+};
+
+BatchExecutor::BatchExecutor(Interpreter *interp) : interp(interp) {}
+
+LoxElement BatchExecutor::call_row(const Token &where, const LoxElement &fn,
+                                   const std::vector<std::vector<double>> &columns, size_t row) {
+  size_t first_arg = this->interp->locals.size();
+  for (auto &column : columns) {
+    this->interp->push_arg(where, LoxElement(column[row]));
+  }
+  this->interpreted_rows++;
+  LoxElement result = this->interp->call_value(where, fn, first_arg);
+  if (this->interp->failed()) {
+    throw this->interp->take_error();
+  }
+  return result;
+}
+
+void BatchExecutor::run(const Token &where, const LoxElement &fn,
+                        const std::vector<std::vector<double>> &columns, const BatchSink &sink) {
+  size_t rows = columns.empty() ? 0 : columns[0].size();
+  for (auto &column : columns) {
+    ASSERT_COND(column.size() == rows, "BatchExecutor: columns of different lengths");
+  }
+
+  // Anything but a Lox function of the right arity gets its exact error (or
+  // result) from the interpreter
+  const FuncStmt *decl = nullptr;
+  if (fn.is_callable() && fn.callable()->kind == CallableKind::USER_FN) {
+    auto *lox_fn = static_cast<LoxFunction *>(fn.callable());
+    if (lox_fn->declaration()->params.size() == columns.size()) {
+      decl = lox_fn->declaration();
+    }
+  }
+
+  for (size_t first = 0; first < rows; first += BATCH_CHUNK) {
+    size_t n = std::min(BATCH_CHUNK, rows - first);
+    ChunkRunner chunk(decl, n);
+    bool vectorized = decl != nullptr;
+    if (vectorized) {
+      try {
+        chunk.run(columns, first);
+      } catch (NotVectorizable &) {
+        vectorized = false;
+      }
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (!vectorized || chunk.result_ty[i] == LaneResult::LANE_INTERPRET) {
+        sink(first + i, call_row(where, fn, columns, first + i));
+        continue;
+      }
+      this->vectorized_rows++;
+      switch (chunk.result_ty[i]) {
+        case LaneResult::LANE_NUM:
+          sink(first + i, LoxElement(chunk.result[i]));
+          break;
+        case LaneResult::LANE_BOOL:
+          sink(first + i, LoxElement(chunk.result[i] != 0));
+          break;
+        default:
+          sink(first + i, LoxElement::nil());
+      }
+    }
+  }
+}
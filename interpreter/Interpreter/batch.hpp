@@ -0,0 +1,52 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+#include "interpreter.hpp"
+#include "../LexParse/tokens.hpp"
+
+/* Vectorized execution of one Lox function over many inputs at once
+ * (jlox --batch=NAME --batch-input=FILE, or BatchExecutor::run).
+ *
+ * Instead of one call per record, the rows are cut into chunks and every AST
+ * node of the function is evaluated once per chunk, over a whole column of
+ * doubles (SSE2 kernels for arithmetic and comparisons). Booleans are 0/1
+ * columns. Control flow is handled with masks: both sides of an if run, each
+ * under the lanes that took it, a while loop keeps going as long as any lane
+ * is still looping and a return retires its lanes.
+ *
+ * The vectorized subset is the pure numeric one: parameters, locals, number
+ * literals, arithmetic, comparisons, and/or/!, if/while/blocks and returns
+ * of numbers or booleans. A function outside of it, or a chunk where the
+ * operand types turn out to be wrong, runs row by row in the interpreter
+ * instead, and so does every single row that would divide by zero, so errors
+ * are reported exactly (and at the same point) as calling the function in a
+ * Lox loop would. */
+
+// Called with the result of every row, in order
+using BatchSink = std::function<void(size_t row, LoxElement result)>;
+
+class BatchExecutor {
+private:
+  Interpreter *interp;
+  long vectorized_rows = 0;
+  long interpreted_rows = 0;
+
+  LoxElement call_row(const Token &where, const LoxElement &fn,
+                      const std::vector<std::vector<double>> &columns, size_t row);
+
+public:
+  BatchExecutor(Interpreter *interp);
+  // Calls "fn" once per row, passing "columns[i][row]" as its i-th argument.
+  // Runtime errors are thrown as usual, after every previous row was passed
+  // to "sink". "where" is the token runtime errors are reported at
+  void run(const Token &where, const LoxElement &fn,
+           const std::vector<std::vector<double>> &columns, const BatchSink &sink);
+  long rows_vectorized() const { return this->vectorized_rows; }
+  long rows_interpreted() const { return this->interpreted_rows; }
+};
+
+#endif // BATCH_H_
@@ -0,0 +1,379 @@
+#include "c_emitter.hpp"
+
+#include <cmath>
+#include <cstdio>
+
+#include "../util.hpp"
+
+// A C string literal with the same bytes as "s"
+static std::string c_string(const std::string &s) {
+  std::string out = "\"";
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c >= 0x20 && c < 0x7F && c != '?') {
+      out += c;
+    } else {
+      // Always three octal digits, so the next character can't extend it
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\%03o", c);
+      out += esc;
+    }
+  }
+  return out + "\"";
+}
+
+std::string CEmitter::fresh(const char *prefix) {
+  return prefix + std::to_string(this->counter++);
+}
+
+std::string CEmitter::token(const Token &tok) {
+  std::string name = fresh("lox_tok_");
+  this->constants += "static const LoxTok " + name + " = {" + c_string(tok.lexeme) + ", " +
+                     std::to_string(tok.get_line()) + "};\n";
+  return "&" + name;
+}
+
+void CEmitter::line(const std::string &code) {
+  auto &frame = this->frames.back();
+  frame.code.append(2 * frame.indent, ' ');
+  frame.code += code;
+  frame.code += '\n';
+}
+
+void CEmitter::open(const std::string &code) {
+  line(code);
+  this->frames.back().indent++;
+}
+
+void CEmitter::close() {
+  this->frames.back().indent--;
+  line("}");
+}
+
+const std::string *CEmitter::resolve(const std::string &name) {
+  auto &scopes = this->frames.back().scopes;
+  for (auto it = scopes.rbegin(); it != scopes.rend(); it++) {
+    auto found = it->vars.find(name);
+    if (found != it->vars.end()) {
+      return &found->second;
+    }
+  }
+  return nullptr;
+}
+
+void CEmitter::define(const std::string &name, const std::string &value) {
+  auto &scope = this->frames.back().scopes.back();
+  auto found = scope.vars.find(name);
+  if (found != scope.vars.end()) {
+    line("lox_store(&" + found->second + ", " + value + ");");
+    return;
+  }
+  // Declared in the C block of the scope, so it lives exactly as long
+  std::string var = fresh("v") + "_" + name;
+  scope.vars[name] = var;
+  scope.order.push_back(var);
+  line("LoxValue " + var + " = " + value + ";");
+}
+
+void CEmitter::release_scope(const Scope &scope) {
+  for (auto &var : scope.order) {
+    line("lox_release(" + var + ");");
+  }
+}
+
+std::string CEmitter::literal(const Literal &lit) {
+  std::string t = fresh("t");
+  switch (lit.ty) {
+    case LiteralTy::LIT_NUMBER: {
+      char num[64];
+      if (std::isinf(lit.number)) {
+        snprintf(num, sizeof(num), "HUGE_VAL");
+      } else {
+        // Hex floats are exact
+        snprintf(num, sizeof(num), "%a", lit.number);
+      }
+      line("LoxValue " + t + " = lox_number(" + num + ");");
+      break;
+    }
+    case LiteralTy::LIT_STRING: {
+      std::string s = fresh("lox_str_");
+      this->constants += "static LoxString " + s + " = {-1, " + std::to_string(lit.str.size()) +
+                         ", " + c_string(lit.str) + "};\n";
+      line("LoxValue " + t + " = lox_string(&" + s + ");");
+      break;
+    }
+    case LiteralTy::LIT_BOOL:
+      line("LoxValue " + t + " = lox_bool(" + (lit.lox_bool ? "1" : "0") + ");");
+      break;
+    case LiteralTy::LIT_NIL:
+      line("LoxValue " + t + " = lox_nil();");
+      break;
+    default:
+      UNREACHABLE();
+  }
+  return t;
+}
+
+std::string CEmitter::binary(const BinaryExpr &binary) {
+  std::string left = expr(*binary.left);
+  std::string right = expr(*binary.right);
+  std::string t = fresh("t");
+  const char *fn;
+  bool checked = true;
+  switch (binary.op.type) {
+    case TokenType::PLUS: fn = "lox_add"; break;
+    case TokenType::MINUS: fn = "lox_sub"; break;
+    case TokenType::STAR: fn = "lox_mul"; break;
+    case TokenType::SLASH: fn = "lox_div"; break;
+    case TokenType::GREATER: fn = "lox_greater"; break;
+    case TokenType::GREATER_EQUAL: fn = "lox_greater_equal"; break;
+    case TokenType::LESS: fn = "lox_less"; break;
+    case TokenType::LESS_EQUAL: fn = "lox_less_equal"; break;
+    case TokenType::EQUAL_EQUAL: fn = "lox_eq"; checked = false; break;
+    case TokenType::BANG_EQUAL: fn = "lox_ne"; checked = false; break;
+    default:
+      UNREACHABLE();
+  }
+  std::string args = checked ? token(binary.op) + ", " : "";
+  line("LoxValue " + t + " = " + fn + "(" + args + left + ", " + right + ");");
+  return t;
+}
+
+std::string CEmitter::logical(const LogicalExpr &logical) {
+  std::string t = expr(*logical.left);
+  // Short-circuits to the left value itself, like the interpreter
+  open(std::string("if (") + (logical.op.type == TokenType::OR ? "!" : "") + "lox_truthy(" + t + ")) {");
+  line("lox_release(" + t + ");");
+  std::string right = expr(*logical.right);
+  line(t + " = " + right + ";");
+  close();
+  return t;
+}
+
+std::string CEmitter::call(const CallExpr &call) {
+  std::string callee = expr(*call.callee);
+  std::vector<std::string> args;
+  for (auto &arg : call.args) {
+    args.push_back(expr(arg));
+  }
+  std::string argv = fresh("args");
+  std::string init = "{";
+  for (size_t i = 0; i < args.size(); i++) {
+    init += (i == 0 ? "" : ", ") + args[i];
+  }
+  if (args.empty()) {
+    init += "{LOX_NIL}";
+  }
+  line("LoxValue " + argv + "[] = " + init + "};");
+  std::string t = fresh("t");
+  line("LoxValue " + t + " = lox_call(" + token(call.paren) + ", " + callee + ", " +
+       std::to_string(args.size()) + ", " + argv + ");");
+  return t;
+}
+
+std::string CEmitter::expr(const Expr &expr) {
+  switch (expr.ty) {
+    case ExprTy::LITERAL:
+      return literal(expr.lit.lit);
+    case ExprTy::GROUPING:
+      return this->expr(*expr.group.expression);
+    case ExprTy::VAR_EXPR: {
+      std::string t = fresh("t");
+      // The interpreter looks at the globals first
+      if (expr.var_expr.name.lexeme == "clock") {
+        line("LoxValue " + t + " = lox_callable(&lox_clock);");
+        return t;
+      }
+      const std::string *var = resolve(expr.var_expr.name.lexeme);
+      if (var == nullptr) {
+        line("lox_undefined(" + token(expr.var_expr.name) + ");");
+        line("LoxValue " + t + " = lox_nil();");
+      } else {
+        line("LoxValue " + t + " = lox_retain(" + *var + ");");
+      }
+      return t;
+    }
+    case ExprTy::ASSIGN_EXPR: {
+      std::string value = this->expr(*expr.ass_expr.value);
+      const std::string *var = resolve(expr.ass_expr.name.lexeme);
+      if (var == nullptr) {
+        line("lox_undefined(" + token(expr.ass_expr.name) + ");");
+      } else {
+        line("lox_store(&" + *var + ", lox_retain(" + value + "));");
+      }
+      std::string t = fresh("t");
+      line("LoxValue " + t + " = lox_assign_result(" + value + ");");
+      return t;
+    }
+    case ExprTy::UNARY: {
+      std::string right = this->expr(*expr.unary.right);
+      std::string t = fresh("t");
+      const char *fn = expr.unary.op.type == TokenType::MINUS ? "lox_neg" : "lox_not";
+      line("LoxValue " + t + " = " + fn + "(" + token(expr.unary.op) + ", " + right + ");");
+      return t;
+    }
+    case ExprTy::BINARY:
+      return binary(expr.bin);
+    case ExprTy::LOGICAL_EXPR:
+      return logical(expr.logical);
+    case ExprTy::CALL_EXPR:
+      return call(expr.call);
+    default:
+      UNREACHABLE();
+  }
+}
+
+void CEmitter::block(const std::vector<Stmt> &statements) {
+  this->frames.back().scopes.emplace_back();
+  for (auto &st : statements) {
+    stmt(st);
+  }
+  release_scope(this->frames.back().scopes.back());
+  this->frames.back().scopes.pop_back();
+}
+
+void CEmitter::function(const FuncStmt *func_stmt) {
+  std::string name = fresh("lox_fn_");
+  this->prototypes += "static LoxValue " + name + "(LoxValue *args);\n";
+  this->prototypes += "static const LoxCallable " + name + "_def = {" +
+                      c_string(func_stmt->name.lexeme) + ", " +
+                      std::to_string(func_stmt->params.size()) + ", " + name + "};\n";
+
+  this->frames.push_back(Frame{});
+  this->frames.back().is_main = false;
+  this->frames.back().scopes.emplace_back();
+  // The body runs in the same scope as the parameters, and the function is
+  // defined after them (shadowing a parameter of the same name)
+  for (size_t i = 0; i < func_stmt->params.size(); i++) {
+    define(func_stmt->params[i].lexeme, "args[" + std::to_string(i) + "]");
+  }
+  define(func_stmt->name.lexeme, "lox_callable(&" + name + "_def)");
+  for (auto &st : func_stmt->body.statements) {
+    stmt(st);
+  }
+  release_scope(this->frames.back().scopes.back());
+  line("return lox_nil();");
+  std::string body = std::move(this->frames.back().code);
+  this->frames.pop_back();
+
+  if (func_stmt->params.empty()) {
+    this->functions += "static LoxValue " + name + "(LoxValue *args) {\n  (void) args;\n";
+  } else {
+    this->functions += "static LoxValue " + name + "(LoxValue *args) {\n";
+  }
+  this->functions += body + "}\n\n";
+  define(func_stmt->name.lexeme, "lox_callable(&" + name + "_def)");
+}
+
+void CEmitter::stmt(const Stmt &stmt) {
+  switch (stmt.ty) {
+    case StmtTy::STMT_EXPR: {
+      open("{");
+      line("lox_release(" + expr(stmt.expression.expr) + ");");
+      close();
+      break;
+    }
+    case StmtTy::STMT_PRINT:
+      open("{");
+      line("lox_print(" + expr(stmt.print.expr) + ");");
+      close();
+      break;
+    case StmtTy::STMT_VAR: {
+      // Evaluated in a nested C block so its temporaries die right away
+      std::string value = fresh("init");
+      line("LoxValue " + value + ";");
+      open("{");
+      if (stmt.var.initializer.is_nil()) {
+        line(value + " = lox_nil();");
+      } else {
+        line(value + " = " + expr(stmt.var.initializer) + ";");
+      }
+      close();
+      define(stmt.var.name.lexeme, value);
+      break;
+    }
+    case StmtTy::STMT_BLOCK:
+      open("{");
+      block(stmt.block.statements);
+      close();
+      break;
+    case StmtTy::STMT_IF: {
+      open("{");
+      std::string cond = expr(stmt.if_stmt.condition);
+      std::string taken = fresh("c");
+      line("int " + taken + " = lox_truthy(" + cond + ");");
+      line("lox_release(" + cond + ");");
+      open("if (" + taken + ") {");
+      this->stmt(*stmt.if_stmt.then_branch);
+      if (stmt.if_stmt.else_branch != nullptr) {
+        this->frames.back().indent--;
+        open("} else {");
+        this->stmt(*stmt.if_stmt.else_branch);
+      }
+      close();
+      close();
+      break;
+    }
+    case StmtTy::STMT_WHILE: {
+      open("for (;;) {");
+      std::string cond = expr(stmt.while_stmt.cond);
+      std::string taken = fresh("c");
+      line("int " + taken + " = lox_truthy(" + cond + ");");
+      line("lox_release(" + cond + ");");
+      open("if (!" + taken + ") {");
+      line("break;");
+      close();
+      this->stmt(*stmt.while_stmt.body);
+      close();
+      break;
+    }
+    case StmtTy::STMT_FUNC:
+      function(stmt.func_stmt);
+      break;
+    case StmtTy::STMT_RETURN: {
+      open("{");
+      std::string value;
+      if (stmt.return_stmt.value.is_nil()) {
+        value = fresh("t");
+        line("LoxValue " + value + " = lox_nil();");
+      } else {
+        value = expr(stmt.return_stmt.value);
+      }
+      if (this->frames.back().is_main) {
+        line("lox_release(" + value + ");");
+        line("lox_top_level_return(" + token(stmt.return_stmt.keyword) + ");");
+      } else {
+        auto &scopes = this->frames.back().scopes;
+        for (auto it = scopes.rbegin(); it != scopes.rend(); it++) {
+          release_scope(*it);
+        }
+        line("return " + value + ";");
+      }
+      close();
+      break;
+    }
+    default:
+      UNREACHABLE();
+  }
+}
+
+std::string CEmitter::emit(const std::vector<Stmt> &statements) {
+  this->frames.push_back(Frame{});
+  this->frames.back().is_main = true;
+  this->frames.back().scopes.emplace_back();
+  for (auto &st : statements) {
+    stmt(st);
+  }
+  release_scope(this->frames.back().scopes.back());
+  line("return 0;");
+  std::string main_body = std::move(this->frames.back().code);
+  this->frames.pop_back();
+
+  std::string out = "/* Generated by jlox --emit-c */\n";
+  out += LOX_C_RUNTIME;
+  out += "\n" + this->prototypes + "\n" + this->constants + "\n" + this->functions;
+  out += "int main(void) {\n" + main_body + "}\n";
+  return out;
+}
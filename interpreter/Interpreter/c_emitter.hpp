@@ -0,0 +1,74 @@
+#ifndef C_EMITTER_H_
+#define C_EMITTER_H_
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../LexParse/expr.hpp"
+#include "../LexParse/stmt.hpp"
+
+/* Ahead-of-time compilation to C (jlox --emit-c out.c script.lox).
+ * The output is a single portable C file (C11 plus gettimeofday) made of the
+ * runtime in c_runtime.cpp followed by the translated program, so
+ * "gcc -O2 out.c" is all it takes to build a standalone binary.
+ *
+ * Scoping in this interpreter is fully static: a block only sees its own
+ * declarations (made so far) and the ones of the blocks around it, a function
+ * only its parameters, itself and its own locals, and "clock" always wins.
+ * So every Lox variable becomes a plain C local and every function a C
+ * function. Only values are dynamic: they're tagged like LoxElement, and all
+ * the type checks (and their error messages) happen at runtime, as in the
+ * interpreter. */
+extern const char *const LOX_C_RUNTIME;
+
+class CEmitter {
+private:
+  struct Scope {
+    // Lox name -> C variable, and the C variables in declaration order
+    std::unordered_map<std::string, std::string> vars;
+    std::vector<std::string> order;
+  };
+
+  // The C function being emitted: main or one per FuncStmt
+  struct Frame {
+    std::string code;
+    std::vector<Scope> scopes;
+    int indent = 1;
+    bool is_main;
+  };
+
+  std::vector<Frame> frames;
+  std::string prototypes;
+  std::string constants;
+  std::string functions;
+  int counter = 0;
+
+  std::string fresh(const char *prefix);
+  std::string token(const Token &tok);
+  void line(const std::string &code);
+  void open(const std::string &code);
+  void close();
+
+  const std::string *resolve(const std::string &name);
+  // Declares "name" in the innermost scope (or re-uses it, the interpreter
+  // allows redefinitions), storing "value" in it
+  void define(const std::string &name, const std::string &value);
+  void release_scope(const Scope &scope);
+
+  std::string literal(const Literal &lit);
+  std::string binary(const BinaryExpr &binary);
+  std::string logical(const LogicalExpr &logical);
+  std::string call(const CallExpr &call);
+  std::string expr(const Expr &expr);
+
+  void block(const std::vector<Stmt> &statements);
+  void function(const FuncStmt *func_stmt);
+  void stmt(const Stmt &stmt);
+
+public:
+  // Returns the whole C translation unit
+  std::string emit(const std::vector<Stmt> &statements);
+};
+
+#endif // C_EMITTER_H_
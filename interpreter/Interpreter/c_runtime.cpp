@@ -0,0 +1,363 @@
+#include "c_emitter.hpp"
+
+/* The runtime every program compiled by --emit-c starts with. It mirrors
+ * LoxElement and the checks in Interpreter::evaluate_*, down to the wording
+ * of the runtime errors, so a compiled program prints exactly what the
+ * interpreter would.
+ *
+ * Ownership: every function taking LoxValues by value consumes them, every
+ * function returning one returns a new reference. Only strings are counted,
+ * literals have a negative count and are never freed. Callables are static
+ * descriptors, since Lox functions don't capture anything.
+ *
+ * Everything is static inline (or marked unused), so a program that only
+ * needs part of the runtime compiles without warnings. */
+const char *const LOX_C_RUNTIME = R"RUNTIME(
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+typedef enum { LOX_NIL, LOX_BOOL, LOX_NUMBER, LOX_STRING, LOX_CALLABLE } LoxTy;
+
+typedef struct LoxString {
+  long refs;
+  size_t len;
+  const char *chars;
+} LoxString;
+
+struct LoxValue;
+
+typedef struct LoxCallable {
+  const char *name; /* NULL for native functions */
+  int arity;
+  struct LoxValue (*code)(struct LoxValue *args);
+} LoxCallable;
+
+typedef struct LoxValue {
+  LoxTy ty;
+  union {
+    int boolean;
+    double number;
+    LoxString *str;
+    const LoxCallable *fn;
+  } as;
+} LoxValue;
+
+/* Where a runtime error is reported */
+typedef struct LoxTok {
+  const char *lexeme;
+  int line;
+} LoxTok;
+
+static inline LoxValue lox_nil(void) {
+  LoxValue v;
+  v.ty = LOX_NIL;
+  v.as.number = 0;
+  return v;
+}
+
+static inline LoxValue lox_bool(int b) {
+  LoxValue v;
+  v.ty = LOX_BOOL;
+  v.as.boolean = b != 0;
+  return v;
+}
+
+static inline LoxValue lox_number(double n) {
+  LoxValue v;
+  v.ty = LOX_NUMBER;
+  v.as.number = n;
+  return v;
+}
+
+static inline LoxValue lox_string(LoxString *s) {
+  LoxValue v;
+  v.ty = LOX_STRING;
+  v.as.str = s;
+  return v;
+}
+
+static inline LoxValue lox_callable(const LoxCallable *fn) {
+  LoxValue v;
+  v.ty = LOX_CALLABLE;
+  v.as.fn = fn;
+  return v;
+}
+
+static inline LoxValue lox_retain(LoxValue v) {
+  if (v.ty == LOX_STRING && v.as.str->refs >= 0) {
+    v.as.str->refs++;
+  }
+  return v;
+}
+
+/* Out of line so gcc doesn't warn about freeing the (never freed) literals
+ * it can see being released */
+#if defined(__GNUC__)
+__attribute__((noinline, unused))
+#endif
+static void lox_drop_string(LoxString *s) {
+  if (s->refs > 0 && --s->refs == 0) {
+    free(s);
+  }
+}
+
+static inline void lox_release(LoxValue v) {
+  if (v.ty == LOX_STRING) {
+    lox_drop_string(v.as.str);
+  }
+}
+
+/* Stores "v" into a variable, dropping what it held before */
+static inline void lox_store(LoxValue *var, LoxValue v) {
+  LoxValue old = *var;
+  *var = v;
+  lox_release(old);
+}
+
+static inline LoxString *lox_alloc_string(size_t len, char **chars) {
+  LoxString *s = (LoxString *) malloc(sizeof(LoxString) + len + 1);
+  if (s == NULL) {
+    fputs("Out of memory\n", stderr);
+    exit(EXIT_FAILURE);
+  }
+  s->refs = 1;
+  s->len = len;
+  *chars = (char *) (s + 1);
+  (*chars)[len] = '\0';
+  s->chars = *chars;
+  return s;
+}
+
+static inline _Noreturn void lox_error_len(const LoxTok *tok, const char *why, size_t len) {
+  printf("Error at: %s on line %d: ", tok->lexeme, tok->line);
+  fwrite(why, 1, len, stdout);
+  putchar('\n');
+  exit(0);
+}
+
+static inline _Noreturn void lox_error(const LoxTok *tok, const char *why) {
+  lox_error_len(tok, why, strlen(why));
+}
+
+static inline _Noreturn void lox_undefined(const LoxTok *tok) {
+  char why[512];
+  snprintf(why, sizeof(why), "Undefined variable '%s'.", tok->lexeme);
+  lox_error(tok, why);
+}
+
+/* A return outside of any function */
+static inline _Noreturn void lox_top_level_return(const LoxTok *keyword) {
+  lox_error(keyword, "Can't return from top-level code.");
+}
+
+static inline int lox_truthy(LoxValue v) {
+  if (v.ty == LOX_BOOL) {
+    return v.as.boolean;
+  }
+  return v.ty != LOX_NIL;
+}
+
+static inline void lox_check_numbers(const LoxTok *op, LoxValue a, LoxValue b) {
+  if (a.ty != LOX_NUMBER || b.ty != LOX_NUMBER) {
+    lox_error(op, "Operand must be a number.");
+  }
+}
+
+static inline LoxValue lox_add(const LoxTok *op, LoxValue a, LoxValue b) {
+  if (a.ty == LOX_NUMBER && b.ty == LOX_NUMBER) {
+    return lox_number(a.as.number + b.as.number);
+  }
+  if (a.ty == LOX_STRING && b.ty == LOX_STRING) {
+    char *chars;
+    LoxString *s = lox_alloc_string(a.as.str->len + b.as.str->len, &chars);
+    memcpy(chars, a.as.str->chars, a.as.str->len);
+    memcpy(chars + a.as.str->len, b.as.str->chars, b.as.str->len);
+    lox_release(a);
+    lox_release(b);
+    return lox_string(s);
+  }
+  lox_error(op, "Operation '+' exists only on numbers and strings");
+}
+
+static inline LoxValue lox_sub(const LoxTok *op, LoxValue a, LoxValue b) {
+  lox_check_numbers(op, a, b);
+  return lox_number(a.as.number - b.as.number);
+}
+
+static inline LoxValue lox_mul(const LoxTok *op, LoxValue a, LoxValue b) {
+  lox_check_numbers(op, a, b);
+  return lox_number(a.as.number * b.as.number);
+}
+
+static inline LoxValue lox_div(const LoxTok *op, LoxValue a, LoxValue b) {
+  lox_check_numbers(op, a, b);
+  if (b.as.number == 0.0) {
+    lox_error(op, "Cannot divide by zero");
+  }
+  return lox_number(a.as.number / b.as.number);
+}
+
+static inline LoxValue lox_greater(const LoxTok *op, LoxValue a, LoxValue b) {
+  lox_check_numbers(op, a, b);
+  return lox_bool(a.as.number > b.as.number);
+}
+
+static inline LoxValue lox_greater_equal(const LoxTok *op, LoxValue a, LoxValue b) {
+  lox_check_numbers(op, a, b);
+  return lox_bool(a.as.number >= b.as.number);
+}
+
+static inline LoxValue lox_less(const LoxTok *op, LoxValue a, LoxValue b) {
+  lox_check_numbers(op, a, b);
+  return lox_bool(a.as.number < b.as.number);
+}
+
+static inline LoxValue lox_less_equal(const LoxTok *op, LoxValue a, LoxValue b) {
+  lox_check_numbers(op, a, b);
+  return lox_bool(a.as.number <= b.as.number);
+}
+
+static inline int lox_equals(LoxValue a, LoxValue b) {
+  int eq;
+  if (a.ty == LOX_NIL || b.ty == LOX_NIL) {
+    eq = a.ty == b.ty;
+  } else if (a.ty != b.ty) {
+    eq = 0;
+  } else if (a.ty == LOX_NUMBER) {
+    eq = a.as.number == b.as.number;
+  } else if (a.ty == LOX_BOOL) {
+    eq = a.as.boolean == b.as.boolean;
+  } else if (a.ty == LOX_STRING) {
+    eq = a.as.str->len == b.as.str->len &&
+         memcmp(a.as.str->chars, b.as.str->chars, a.as.str->len) == 0;
+  } else {
+    /* Callables are never equal, not even to themselves, and the
+     * interpreter complains about it */
+    fflush(stdout);
+    fputs("Unknown LoxElement type. This should never happen\n", stderr);
+    eq = 0;
+  }
+  lox_release(a);
+  lox_release(b);
+  return eq;
+}
+
+static inline LoxValue lox_eq(LoxValue a, LoxValue b) { return lox_bool(lox_equals(a, b)); }
+
+static inline LoxValue lox_ne(LoxValue a, LoxValue b) { return lox_bool(!lox_equals(a, b)); }
+
+static inline LoxValue lox_neg(const LoxTok *op, LoxValue v) {
+  if (v.ty != LOX_NUMBER) {
+    lox_error(op, "Operand must be a number.");
+  }
+  return lox_number(-v.as.number);
+}
+
+static inline LoxValue lox_not(const LoxTok *op, LoxValue v) {
+  if (v.ty != LOX_BOOL) {
+    lox_error(op, "Operand must be a boolean.");
+  }
+  return lox_bool(!v.as.boolean);
+}
+
+static LoxString lox_empty_string = {-1, 0, ""};
+
+/* The value of an assignment expression. The interpreter moves the value
+ * into the variable and returns a copy of what is left behind, which for a
+ * string is the empty string */
+static inline LoxValue lox_assign_result(LoxValue v) {
+  if (v.ty == LOX_STRING) {
+    lox_release(v);
+    return lox_string(&lox_empty_string);
+  }
+  return v;
+}
+
+/* Same text as LoxElement::format_number */
+static inline void lox_print_number(double num) {
+  if (fabs(num) < 1e15 && num == (double) (long long) num) {
+    printf("%.0f\n", num);
+    return;
+  }
+  if (!isfinite(num)) {
+    printf("%g\n", num);
+    return;
+  }
+  int digits = 1;
+  for (; digits < 17; digits++) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.*e", digits - 1, num);
+    if (strtod(buf, NULL) == num) {
+      break;
+    }
+  }
+  printf("%.*g\n", digits, num);
+}
+
+static inline void lox_print(LoxValue v) {
+  switch (v.ty) {
+    case LOX_NIL:
+      puts("nil");
+      break;
+    case LOX_BOOL:
+      puts(v.as.boolean ? "true" : "false");
+      break;
+    case LOX_NUMBER:
+      lox_print_number(v.as.number);
+      break;
+    case LOX_STRING:
+      fwrite(v.as.str->chars, 1, v.as.str->len, stdout);
+      putchar('\n');
+      break;
+    case LOX_CALLABLE:
+      if (v.as.fn->name == NULL) {
+        puts("<native fn>");
+      } else {
+        printf("<fn %s>\n", v.as.fn->name);
+      }
+      break;
+  }
+  lox_release(v);
+}
+
+/* Consumes "args", the callee takes ownership of them */
+static inline LoxValue lox_call(const LoxTok *paren, LoxValue callee, int argc, LoxValue *args) {
+  if (callee.ty != LOX_CALLABLE) {
+    lox_error(paren, "Can only call functions and classes.");
+  }
+  if (argc != callee.as.fn->arity) {
+    /* Same message as the interpreter, which appends both counts as chars */
+    char why[64];
+    size_t len = 0;
+    memcpy(why, "Expected ", 9);
+    len += 9;
+    why[len++] = (char) callee.as.fn->arity;
+    memcpy(why + len, " arguments but got ", 19);
+    len += 19;
+    why[len++] = (char) argc;
+    why[len++] = '.';
+    lox_error_len(paren, why, len);
+  }
+  return callee.as.fn->code(args);
+}
+
+static inline LoxValue lox_clock_code(LoxValue *args) {
+  struct timeval tv;
+  long long t;
+  (void) args;
+  gettimeofday(&tv, NULL);
+  /* Same arithmetic as the interpreter's get_system_time */
+  t = tv.tv_sec;
+  t *= 1000;
+  t = tv.tv_usec / 1000;
+  return lox_number((double) t);
+}
+
+#if defined(__GNUC__)
+__attribute__((unused))
+#endif
+static const LoxCallable lox_clock = {NULL, 0, lox_clock_code};
+)RUNTIME";
@@ -0,0 +1,408 @@
+#include "closure_compiler.hpp"
+
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+
+#include "../util.hpp"
+#include "lox_function.hpp"
+
+/* Binary operands come in three shapes. Anything can be an ExprOperand
+ * (a compiled closure producing a fresh LoxElement), but reading a variable or
+ * a number literal is so common in arithmetic and comparisons that we
+ * specialize on it: a VarOperand reads the element in place without copying
+ * it and a NumOperand is just the double itself, with its type check folded
+ * away at compile time. */
+struct ClosureCompiler::ExprOperand {
+    CompiledExpr code;
+    static constexpr bool can_be_string = true;
+    LoxElement get(Interpreter *interp) const { return this->code(interp); }
+};
+
+struct ClosureCompiler::VarOperand {
+    const VariableExpr *var;
+    static constexpr bool can_be_string = true;
+    const LoxElement &get(Interpreter *interp) const {
+        return interp->evaluate_variable_expr(*this->var);
+    }
+};
+
+struct ClosureCompiler::NumOperand {
+    double value;
+    static constexpr bool can_be_string = false;
+    double get(Interpreter *) const { return this->value; }
+};
+
+static bool is_number(const LoxElement &el) { return el.is_number(); }
+static bool is_number(double) { return true; }
+static double num(const LoxElement &el) { return el.lox_number(); }
+static double num(double d) { return d; }
+
+/* The arithmetic and comparison operators which only accept numbers.
+ * "op" is only used for diagnostics */
+struct SubOp {
+    static LoxElement apply(Interpreter *, const Token *, double l, double r) { return LoxElement(l - r); }
+};
+struct MulOp {
+    static LoxElement apply(Interpreter *, const Token *, double l, double r) { return LoxElement(l * r); }
+};
+struct DivOp {
+    static LoxElement apply(Interpreter *interp, const Token *op, double l, double r) {
+        if (r == 0.0) {
+            interp->raise(*op, "Cannot divide by zero");
+            return LoxElement::nil();
+        }
+        return LoxElement(l / r);
+    }
+};
+struct GreaterOp {
+    static LoxElement apply(Interpreter *, const Token *, double l, double r) { return LoxElement(l > r); }
+};
+struct GreaterEqualOp {
+    static LoxElement apply(Interpreter *, const Token *, double l, double r) { return LoxElement(l >= r); }
+};
+struct LessOp {
+    static LoxElement apply(Interpreter *, const Token *, double l, double r) { return LoxElement(l < r); }
+};
+struct LessEqualOp {
+    static LoxElement apply(Interpreter *, const Token *, double l, double r) { return LoxElement(l <= r); }
+};
+
+template <typename Op, typename L, typename R>
+static CompiledExpr numeric_binary(const Token *op, L left, R right) {
+    return [op, left = std::move(left), right = std::move(right)](Interpreter *interp) -> LoxElement {
+        auto &&l = left.get(interp);
+        auto &&r = right.get(interp);
+        if (!is_number(l) || !is_number(r)) {
+            interp->raise(*op, "Operand must be a number.");
+            return LoxElement::nil();
+        }
+        return Op::apply(interp, op, num(l), num(r));
+    };
+}
+
+template <typename L, typename R>
+static CompiledExpr plus_binary(const Token *op, L left, R right) {
+    return [op, left = std::move(left), right = std::move(right)](Interpreter *interp) -> LoxElement {
+        auto &&l = left.get(interp);
+        auto &&r = right.get(interp);
+        if (is_number(l) && is_number(r)) {
+            return LoxElement(num(l) + num(r));
+        }
+        if constexpr (L::can_be_string && R::can_be_string) {
+            if (l.ty() == LoxTy::LOX_STRING && r.ty() == LoxTy::LOX_STRING) {
+                return LoxElement(LoxString::concat(*l.as_string(), *r.as_string()));
+            }
+        }
+        interp->raise(*op, "Operation '+' exists only on numbers and strings");
+        return LoxElement::nil();
+    };
+}
+
+template <typename L, typename R>
+static CompiledExpr binary_with(const Token *op, L left, R right) {
+    switch (op->type) {
+        case TokenType::MINUS:
+            return numeric_binary<SubOp>(op, std::move(left), std::move(right));
+        case TokenType::SLASH:
+            return numeric_binary<DivOp>(op, std::move(left), std::move(right));
+        case TokenType::STAR:
+            return numeric_binary<MulOp>(op, std::move(left), std::move(right));
+        case TokenType::PLUS:
+            return plus_binary(op, std::move(left), std::move(right));
+        case TokenType::GREATER:
+            return numeric_binary<GreaterOp>(op, std::move(left), std::move(right));
+        case TokenType::GREATER_EQUAL:
+            return numeric_binary<GreaterEqualOp>(op, std::move(left), std::move(right));
+        case TokenType::LESS:
+            return numeric_binary<LessOp>(op, std::move(left), std::move(right));
+        case TokenType::LESS_EQUAL:
+            return numeric_binary<LessEqualOp>(op, std::move(left), std::move(right));
+        default:
+            throw std::runtime_error("Unknown binary operator when compiling. This should never happen");
+    }
+}
+
+static bool is_number_literal(const Expr &expr) {
+    return expr.ty == ExprTy::LITERAL && expr.lit.lit.ty == LiteralTy::LIT_NUMBER;
+}
+
+CompiledExpr ClosureCompiler::compile_binary(const BinaryExpr &binary) {
+    const Token *op = &binary.op;
+    const Expr &left = *binary.left;
+    const Expr &right = *binary.right;
+
+    if (op->type == TokenType::EQUAL_EQUAL || op->type == TokenType::BANG_EQUAL) {
+        bool negate = op->type == TokenType::BANG_EQUAL;
+        return [l = compile(left), r = compile(right), negate](Interpreter *interp) -> LoxElement {
+            auto lhs = l(interp);
+            auto rhs = r(interp);
+            return LoxElement(lhs.equals(rhs) != negate);
+        };
+    }
+
+    // A variable can only be read in place on the left if evaluating the right
+    // operand cannot run arbitrary code (which could reassign or redefine it)
+    bool right_is_pure = is_number_literal(right) || right.ty == ExprTy::VAR_EXPR;
+    if (left.ty == ExprTy::VAR_EXPR && right_is_pure) {
+        VarOperand l{&left.var_expr};
+        if (is_number_literal(right)) {
+            return binary_with(op, l, NumOperand{right.lit.lit.number});
+        }
+        return binary_with(op, l, VarOperand{&right.var_expr});
+    }
+    if (is_number_literal(left)) {
+        NumOperand l{left.lit.lit.number};
+        if (is_number_literal(right)) {
+            return binary_with(op, l, NumOperand{right.lit.lit.number});
+        }
+        if (right.ty == ExprTy::VAR_EXPR) {
+            return binary_with(op, l, VarOperand{&right.var_expr});
+        }
+        return binary_with(op, l, ExprOperand{compile(right)});
+    }
+
+    ExprOperand l{compile(left)};
+    if (is_number_literal(right)) {
+        return binary_with(op, std::move(l), NumOperand{right.lit.lit.number});
+    }
+    if (right.ty == ExprTy::VAR_EXPR) {
+        return binary_with(op, std::move(l), VarOperand{&right.var_expr});
+    }
+    return binary_with(op, std::move(l), ExprOperand{compile(right)});
+}
+
+// String literals never get here: compile() has the interpreter evaluate
+// them, so they share its interned value
+CompiledExpr ClosureCompiler::compile_literal(const Literal &literal) {
+    switch (literal.ty) {
+        case LiteralTy::LIT_BOOL:
+            return [b = literal.lox_bool](Interpreter *) { return LoxElement(b); };
+        case LiteralTy::LIT_NIL:
+            return [](Interpreter *) { return LoxElement::nil(); };
+        case LiteralTy::LIT_NUMBER:
+            return [n = literal.number](Interpreter *) { return LoxElement(n); };
+        default:
+            throw std::runtime_error("Unknown Literal type. This should never happen");
+    }
+}
+
+CompiledExpr ClosureCompiler::compile_unary(const UnaryExpr &unary) {
+    const Token *op = &unary.op;
+    auto right = compile(*unary.right);
+    switch (op->type) {
+        case TokenType::MINUS:
+            return [op, right = std::move(right)](Interpreter *interp) {
+                auto r = right(interp);
+                if (!interp->check_number_operand(*op, r)) {
+                    return LoxElement::nil();
+                }
+                return LoxElement(-r.lox_number());
+            };
+        case TokenType::BANG:
+            return [op, right = std::move(right)](Interpreter *interp) {
+                auto r = right(interp);
+                if (!interp->check_bool_operand(*op, r)) {
+                    return LoxElement::nil();
+                }
+                return LoxElement(!r.is_truthy());
+            };
+        default:
+            throw std::runtime_error(
+                    "Unknown unary operator when compiling expression.");
+    }
+}
+
+CompiledExpr ClosureCompiler::compile_logical(const LogicalExpr &logical) {
+    auto left = compile(*logical.left);
+    auto right = compile(*logical.right);
+    if (logical.op.type == TokenType::OR) {
+        return [left = std::move(left), right = std::move(right)](Interpreter *interp) {
+            auto l = left(interp);
+            if (l.is_truthy()) {
+                return l;
+            }
+            return right(interp);
+        };
+    }
+    return [left = std::move(left), right = std::move(right)](Interpreter *interp) {
+        auto l = left(interp);
+        if (!l.is_truthy()) {
+            return l;
+        }
+        return right(interp);
+    };
+}
+
+CompiledExpr ClosureCompiler::compile_call(const CallExpr &call) {
+    std::vector<CompiledExpr> args{};
+    args.reserve(call.args.size());
+    for (auto &arg : call.args) {
+        args.push_back(compile(arg));
+    }
+    return [callee = compile(*call.callee), args = std::move(args), paren = &call.paren](Interpreter *interp) {
+        auto fn = callee(interp);
+        size_t first_arg = interp->locals.size();
+        for (auto &arg : args) {
+            interp->push_arg(*paren, arg(interp));
+        }
+        return interp->call_value(*paren, fn, first_arg);
+    };
+}
+
+CompiledExpr ClosureCompiler::compile(const Expr &expr) {
+    switch (expr.ty) {
+        case ExprTy::BINARY:
+            return compile_binary(expr.bin);
+        case ExprTy::UNARY:
+            return compile_unary(expr.unary);
+        case ExprTy::GROUPING:
+            // Groupings only matter to the parser, they compile to nothing
+            return compile(*expr.group.expression);
+        case ExprTy::LITERAL:
+            if (expr.lit.lit.ty == LiteralTy::LIT_STRING) {
+                return [lit = &expr.lit](Interpreter *interp) { return interp->evaluate_literal_expr(*lit); };
+            }
+            return compile_literal(expr.lit.lit);
+        case ExprTy::VAR_EXPR:
+            return [var = &expr.var_expr](Interpreter *interp) {
+                return interp->evaluate_variable_expr(*var).copy();
+            };
+        case ExprTy::ASSIGN_EXPR:
+            return [value = compile(*expr.ass_expr.value), assign = &expr.ass_expr](Interpreter *interp) {
+                return interp->assign_value(*assign, value(interp));
+            };
+        case ExprTy::LOGICAL_EXPR:
+            return compile_logical(expr.logical);
+        case ExprTy::CALL_EXPR:
+            return compile_call(expr.call);
+        default:
+            throw std::runtime_error(
+                    "Unknown expression type when compiling. This should never happen");
+    }
+}
+
+CompiledStmt ClosureCompiler::compile_block(const Block &block) {
+    return [body = compile(block.statements)](Interpreter *interp) {
+        ValueStack::Scope scope{interp->locals};
+        return interp->execute_statements(body);
+    };
+}
+
+CompiledStmt ClosureCompiler::compile_if(const IfStmt &if_stmt) {
+    auto cond = compile(if_stmt.condition);
+    auto then_branch = compile(*if_stmt.then_branch);
+    if (if_stmt.else_branch == nullptr) {
+        return [cond = std::move(cond), then_branch = std::move(then_branch)](Interpreter *interp) {
+            bool taken = cond(interp).is_truthy();
+            if (interp->failed()) {
+                return Completion::ERROR;
+            }
+            if (taken) {
+                return then_branch(interp);
+            }
+            return Completion::NORMAL;
+        };
+    }
+    return [cond = std::move(cond), then_branch = std::move(then_branch),
+            else_branch = compile(*if_stmt.else_branch)](Interpreter *interp) {
+        bool taken = cond(interp).is_truthy();
+        if (interp->failed()) {
+            return Completion::ERROR;
+        }
+        if (taken) {
+            return then_branch(interp);
+        }
+        return else_branch(interp);
+    };
+}
+
+CompiledStmt ClosureCompiler::compile_while(const WhileStmt &while_stmt) {
+    return [cond = compile(while_stmt.cond), body = compile(*while_stmt.body)](Interpreter *interp) {
+        while (cond(interp).is_truthy() && !interp->failed()) {
+            Completion completion = body(interp);
+            if (completion != Completion::NORMAL) {
+                return completion;
+            }
+        }
+        return interp->status();
+    };
+}
+
+CompiledStmt ClosureCompiler::compile_func(const FuncStmt *func_stmt) {
+    const CompiledBlock *body = &this->bodies.emplace(func_stmt, compile(func_stmt->body.statements)).first->second;
+    return [func_stmt, body](Interpreter *interp) {
+        auto *lox_fun = new LoxFunction(func_stmt, body, interp->jit_function_for(func_stmt));
+        interp->define_local(func_stmt->name, LoxElement(lox_fun));
+        return interp->status();
+    };
+}
+
+const CompiledBlock *ClosureCompiler::body_of(const FuncStmt *decl) const {
+    auto it = this->bodies.find(decl);
+    return it == this->bodies.end() ? nullptr : &it->second;
+}
+
+CompiledStmt ClosureCompiler::compile(const Stmt &stmt) {
+    switch (stmt.ty) {
+        case StmtTy::STMT_EXPR:
+            return [expr = compile(stmt.expression.expr)](Interpreter *interp) {
+                expr(interp);
+                return interp->status();
+            };
+        case StmtTy::STMT_PRINT:
+            return [expr = compile(stmt.print.expr)](Interpreter *interp) {
+                LoxElement value = expr(interp);
+                if (interp->failed()) {
+                    return Completion::ERROR;
+                }
+                interp->print(value);
+                return Completion::NORMAL;
+            };
+        case StmtTy::STMT_VAR:
+            if (stmt.var.initializer.is_nil()) {
+                return [name = &stmt.var.name](Interpreter *interp) {
+                    interp->define_local(*name, LoxElement::nil());
+                    return interp->status();
+                };
+            }
+            return [init = compile(stmt.var.initializer), name = &stmt.var.name](Interpreter *interp) {
+                interp->define_local(*name, init(interp));
+                return interp->status();
+            };
+        case StmtTy::STMT_BLOCK:
+            return compile_block(stmt.block);
+        case StmtTy::STMT_WHILE:
+            return compile_while(stmt.while_stmt);
+        case StmtTy::STMT_IF:
+            return compile_if(stmt.if_stmt);
+        case StmtTy::STMT_FUNC:
+            return compile_func(stmt.func_stmt);
+        case StmtTy::STMT_RETURN:
+            if (stmt.return_stmt.value.is_nil()) {
+                return [keyword = &stmt.return_stmt.keyword](Interpreter *interp) {
+                    interp->return_keyword = keyword;
+                    interp->return_value = LoxElement::nil();
+                    return Completion::RETURN;
+                };
+            }
+            return [keyword = &stmt.return_stmt.keyword,
+                    value = compile(stmt.return_stmt.value)](Interpreter *interp) {
+                interp->return_value = value(interp);
+                // After the value, whose calls complete returns of their own
+                interp->return_keyword = keyword;
+                return interp->failed() ? Completion::ERROR : Completion::RETURN;
+            };
+        default:
+            throw std::runtime_error("Unknown Statement type when compiling. This should never happen");
+    }
+}
+
+CompiledBlock ClosureCompiler::compile(const std::vector<Stmt> &statements) {
+    CompiledBlock block{};
+    block.statements.reserve(statements.size());
+    for (auto &st : statements) {
+        block.statements.push_back(compile(st));
+    }
+    return block;
+}
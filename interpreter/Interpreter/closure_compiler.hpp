@@ -0,0 +1,60 @@
+#ifndef CLOSURE_COMPILER_H_
+#define CLOSURE_COMPILER_H_
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "interpreter.hpp"
+#include "../LexParse/expr.hpp"
+#include "../LexParse/stmt.hpp"
+
+/* The closure-compilation engine (--engine=closure).
+ * Every Expr/Stmt is converted once into a tree of pre-bound C++ callables,
+ * each of them already specialized to its operator (and, where it is known
+ * statically, to the kind of its operands: number literals and plain variable
+ * reads), so running the program never goes through the "switch (expr.ty)" in
+ * Interpreter::evaluate or the "switch (binary.op.type)" in
+ * Interpreter::evaluate_binary_expr again.
+ * The closures keep pointers into the AST (names, tokens for diagnostics and
+ * function declarations), so the AST must outlive the compiled code */
+using CompiledExpr = std::function<LoxElement(Interpreter *)>;
+using CompiledStmt = std::function<Completion(Interpreter *)>;
+
+class CompiledBlock {
+public:
+    std::vector<CompiledStmt> statements;
+};
+
+class ClosureCompiler {
+private:
+    // How a binary operand is produced, see closure_compiler.cpp
+    struct ExprOperand;
+    struct VarOperand;
+    struct NumOperand;
+
+    // Function bodies are compiled once, together with their declaration, and
+    // live here for as long as the compiler does, since LoxFunctions point
+    // into this map (nodes of an unordered_map never move)
+    std::unordered_map<const FuncStmt *, CompiledBlock> bodies;
+
+    CompiledExpr compile_literal(const Literal &literal);
+    CompiledExpr compile_unary(const UnaryExpr &unary);
+    CompiledExpr compile_binary(const BinaryExpr &binary);
+    CompiledExpr compile_logical(const LogicalExpr &logical);
+    CompiledExpr compile_call(const CallExpr &call);
+
+    CompiledStmt compile_block(const Block &block);
+    CompiledStmt compile_if(const IfStmt &if_stmt);
+    CompiledStmt compile_while(const WhileStmt &while_stmt);
+    CompiledStmt compile_func(const FuncStmt *func_stmt);
+
+public:
+    CompiledExpr compile(const Expr &expr);
+    CompiledStmt compile(const Stmt &stmt);
+    CompiledBlock compile(const std::vector<Stmt> &statements);
+    // The body compiled along with "decl", nullptr if it wasn't
+    const CompiledBlock *body_of(const FuncStmt *decl) const;
+};
+
+#endif // CLOSURE_COMPILER_H_
@@ -0,0 +1,434 @@
+#include "heap.hpp"
+
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#define POISON(mem, size) ASAN_POISON_MEMORY_REGION(mem, size)
+#define UNPOISON(mem, size) ASAN_UNPOISON_MEMORY_REGION(mem, size)
+#else
+#define POISON(mem, size)
+#define UNPOISON(mem, size)
+#endif
+
+// The header at the start of every chunk, which is CHUNK_SIZE aligned so an
+// object finds its chunk by masking its address
+struct LoxHeap::Chunk {
+  char *top;
+  long live_objects;
+  size_t live_bytes;
+  // In the old generation or free list, or the region's chunks
+  Chunk *prev;
+  Chunk *next;
+  // The region the chunk belongs to, nullptr outside of regions
+  LoxHeap::Region *region;
+};
+
+using Chunk = LoxHeap::Chunk;
+
+static constexpr size_t ALIGN = alignof(std::max_align_t);
+static constexpr size_t HEADER_SIZE = (sizeof(Chunk) + ALIGN - 1) / ALIGN * ALIGN;
+// Empty chunks kept around for the nursery, the rest go back to malloc
+static constexpr size_t MAX_FREE_CHUNKS = 16;
+
+/* The block of an object that died. It stays on the free list of its size
+ * class until an allocation of that size takes it, or a smaller one that
+ * leaves enough behind for another free block, or its chunk empties. Blocks
+ * tile [chunk_start, top) of every chunk, live ones and free ones, so a
+ * chunk whose objects have all died can walk its free blocks to take them
+ * off their lists */
+struct FreeBlock {
+  FreeBlock *prev;
+  FreeBlock *next;
+  size_t size;
+};
+
+static constexpr size_t MIN_BLOCK = (sizeof(FreeBlock) + ALIGN - 1) / ALIGN * ALIGN;
+static constexpr size_t SIZE_CLASSES = (LoxHeap::MAX_SMALL - MIN_BLOCK) / ALIGN + 1;
+static_assert(SIZE_CLASSES <= 64, "A class has to fit in free_classes");
+
+static LoxHeap::Stats heap_stats;
+static Chunk *nursery = nullptr;
+static Chunk *old_generation = nullptr;
+static Chunk *free_chunks = nullptr;
+static size_t free_count = 0;
+static LoxHeap::Region *current_region = nullptr;
+static FreeBlock *free_blocks[SIZE_CLASSES];
+// Bit n is set when free_blocks[n] isn't empty
+static uint64_t free_classes = 0;
+
+// Large objects are prefixed with the region they came from (nullptr for
+// none) and their place in its list, so release can tell them apart
+struct LargeHeader {
+  LoxHeap::Region *region;
+  size_t slot;
+};
+static constexpr size_t LARGE_PREFIX = alignof(std::max_align_t);
+static_assert(sizeof(LargeHeader) <= LARGE_PREFIX);
+
+// Every block can hold a FreeBlock once its object dies
+static size_t round_up(size_t size) {
+  size = (size + ALIGN - 1) / ALIGN * ALIGN;
+  return size < MIN_BLOCK ? MIN_BLOCK : size;
+}
+
+static size_t size_class(size_t size) { return (size - MIN_BLOCK) / ALIGN; }
+
+static char *chunk_start(Chunk *chunk) { return reinterpret_cast<char *>(chunk) + HEADER_SIZE; }
+
+static char *chunk_end(Chunk *chunk) { return reinterpret_cast<char *>(chunk) + LoxHeap::CHUNK_SIZE; }
+
+static Chunk *chunk_of(void *mem) {
+  return reinterpret_cast<Chunk *>(reinterpret_cast<uintptr_t>(mem) & ~(LoxHeap::CHUNK_SIZE - 1));
+}
+
+static void push_free(void *mem, size_t size) {
+  UNPOISON(mem, sizeof(FreeBlock));
+  auto *block = static_cast<FreeBlock *>(mem);
+  size_t cls = size_class(size);
+  block->prev = nullptr;
+  block->next = free_blocks[cls];
+  block->size = size;
+  if (block->next != nullptr) {
+    block->next->prev = block;
+  }
+  free_blocks[cls] = block;
+  free_classes |= uint64_t{1} << cls;
+  heap_stats.free_bytes += size;
+}
+
+static void unlink_free(FreeBlock *block) {
+  size_t cls = size_class(block->size);
+  if (block->prev != nullptr) {
+    block->prev->next = block->next;
+  } else {
+    free_blocks[cls] = block->next;
+    if (block->next == nullptr) {
+      free_classes &= ~(uint64_t{1} << cls);
+    }
+  }
+  if (block->next != nullptr) {
+    block->next->prev = block->prev;
+  }
+  heap_stats.free_bytes -= block->size;
+}
+
+// Hands out a free block of exactly "size", or splits a bigger one, nullptr
+// if there is neither
+static void *take_free(size_t size) {
+  size_t cls = size_class(size);
+  uint64_t fits = free_classes & (uint64_t{1} << cls);
+  if (fits == 0 && cls + MIN_BLOCK / ALIGN < SIZE_CLASSES) {
+    // What's left of a split has to make a block of its own
+    fits = free_classes & (~uint64_t{0} << (cls + MIN_BLOCK / ALIGN));
+  }
+  if (fits == 0) {
+    return nullptr;
+  }
+  FreeBlock *block = free_blocks[std::countr_zero(fits)];
+  unlink_free(block);
+  size_t rest = block->size - size;
+  char *mem = reinterpret_cast<char *>(block);
+  if (rest != 0) {
+    push_free(mem + size, rest);
+  }
+  UNPOISON(mem, size);
+  return mem;
+}
+
+// Takes the blocks of a chunk whose objects have all died off the free lists
+static void forget_free(Chunk *chunk) {
+  char *at = chunk_start(chunk);
+  while (at < chunk->top) {
+    auto *block = reinterpret_cast<FreeBlock *>(at);
+    at += block->size;
+    unlink_free(block);
+  }
+}
+
+static void reset(Chunk *chunk) {
+  chunk->top = chunk_start(chunk);
+  chunk->live_objects = 0;
+  chunk->live_bytes = 0;
+  chunk->prev = nullptr;
+  chunk->next = nullptr;
+  chunk->region = nullptr;
+  POISON(chunk_start(chunk), chunk_end(chunk) - chunk_start(chunk));
+}
+
+static Chunk *new_chunk() {
+  void *mem = std::aligned_alloc(LoxHeap::CHUNK_SIZE, LoxHeap::CHUNK_SIZE);
+  if (mem == nullptr) {
+    throw std::bad_alloc{};
+  }
+  auto *chunk = static_cast<Chunk *>(mem);
+  reset(chunk);
+  heap_stats.chunks_in_use++;
+  if (heap_stats.chunks_in_use > heap_stats.max_chunks_in_use) {
+    heap_stats.max_chunks_in_use = heap_stats.chunks_in_use;
+  }
+  return chunk;
+}
+
+static void free_chunk(Chunk *chunk) {
+  reset(chunk);
+  if (free_count < MAX_FREE_CHUNKS) {
+    chunk->next = free_chunks;
+    free_chunks = chunk;
+    free_count++;
+    return;
+  }
+  UNPOISON(chunk_start(chunk), chunk_end(chunk) - chunk_start(chunk));
+  std::free(chunk);
+  heap_stats.chunks_in_use--;
+}
+
+static void tenure(Chunk *chunk) {
+  // The end the nursery couldn't fit its last allocation in is free too,
+  // it's smaller than that allocation and so than MAX_SMALL
+  size_t rest = chunk_end(chunk) - chunk->top;
+  if (rest >= MIN_BLOCK) {
+    push_free(chunk->top, rest);
+    chunk->top = chunk_end(chunk);
+  }
+  chunk->prev = nullptr;
+  chunk->next = old_generation;
+  if (old_generation != nullptr) {
+    old_generation->prev = chunk;
+  }
+  old_generation = chunk;
+  heap_stats.chunks_tenured++;
+  heap_stats.bytes_promoted += chunk->live_bytes;
+}
+
+// Takes back the old chunks nothing lives in anymore
+static void sweep() {
+  auto start = std::chrono::steady_clock::now();
+  Chunk *chunk = old_generation;
+  while (chunk != nullptr) {
+    Chunk *next = chunk->next;
+    if (chunk->live_objects == 0) {
+      forget_free(chunk);
+      if (chunk->prev != nullptr) {
+        chunk->prev->next = next;
+      } else {
+        old_generation = next;
+      }
+      if (next != nullptr) {
+        next->prev = chunk->prev;
+      }
+      free_chunk(chunk);
+      heap_stats.chunks_swept++;
+    }
+    chunk = next;
+  }
+  double pause = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+  heap_stats.sweeps++;
+  heap_stats.total_pause_us += pause;
+  if (pause > heap_stats.max_pause_us) {
+    heap_stats.max_pause_us = pause;
+  }
+}
+
+static Chunk *take_chunk() {
+  if (free_chunks == nullptr) {
+    return new_chunk();
+  }
+  Chunk *chunk = free_chunks;
+  free_chunks = chunk->next;
+  chunk->next = nullptr;
+  free_count--;
+  return chunk;
+}
+
+static void next_nursery() {
+  if (nursery != nullptr) {
+    if (nursery->live_objects == 0) {
+      forget_free(nursery);
+      reset(nursery);
+      heap_stats.nursery_resets++;
+      return;
+    }
+    tenure(nursery);
+    nursery = nullptr;
+  }
+  if (free_chunks == nullptr && old_generation != nullptr) {
+    sweep();
+  }
+  nursery = take_chunk();
+}
+
+static void *allocate_large(size_t size, LoxHeap::Region *region, size_t slot) {
+  auto *mem = static_cast<char *>(::operator new(LARGE_PREFIX + size));
+  ::new (mem) LargeHeader{region, slot};
+  return mem + LARGE_PREFIX;
+}
+
+static void *allocate_in_region(LoxHeap::Region *region, Chunk *&chunks, size_t size) {
+  if (chunks == nullptr || chunks->top + size > chunk_end(chunks)) {
+    Chunk *chunk = take_chunk();
+    chunk->region = region;
+    chunk->next = chunks;
+    if (chunks != nullptr) {
+      chunks->prev = chunk;
+    }
+    chunks = chunk;
+  }
+  void *mem = chunks->top;
+  UNPOISON(mem, size);
+  chunks->top += size;
+  chunks->live_objects++;
+  return mem;
+}
+
+// Region chunks are only counted, not swept: the one we're allocating from
+// starts over once it's empty, and the older ones go back to the free list
+static void release_in_region(Chunk *chunk, Chunk *&chunks) {
+  if (--chunk->live_objects != 0) {
+    return;
+  }
+  if (chunk == chunks) {
+    chunk->top = chunk_start(chunk);
+    return;
+  }
+  chunk->prev->next = chunk->next;
+  if (chunk->next != nullptr) {
+    chunk->next->prev = chunk->prev;
+  }
+  free_chunk(chunk);
+}
+
+void *LoxHeap::allocate(size_t size) {
+  size = round_up(size);
+  if (current_region != nullptr) {
+    Region *region = current_region;
+    void *mem;
+    if (size > MAX_SMALL) {
+      mem = allocate_large(size, region, region->large.size());
+      region->large.push_back(static_cast<char *>(mem) - LARGE_PREFIX);
+    } else {
+      mem = allocate_in_region(region, region->chunks, size);
+    }
+    region->bytes += size;
+    region->objects++;
+    region->live_objects++;
+    return mem;
+  }
+  if (size > MAX_SMALL) {
+    heap_stats.large_allocations++;
+    return allocate_large(size, nullptr, 0);
+  }
+  if (free_classes != 0) {
+    void *mem = take_free(size);
+    if (mem != nullptr) {
+      Chunk *chunk = chunk_of(mem);
+      chunk->live_objects++;
+      chunk->live_bytes += size;
+      heap_stats.small_allocations++;
+      heap_stats.bytes_allocated += size;
+      heap_stats.bytes_reused += size;
+      return mem;
+    }
+  }
+  if (nursery == nullptr || nursery->top + size > chunk_end(nursery)) {
+    next_nursery();
+  }
+  void *mem = nursery->top;
+  UNPOISON(mem, size);
+  nursery->top += size;
+  nursery->live_objects++;
+  nursery->live_bytes += size;
+  heap_stats.small_allocations++;
+  heap_stats.bytes_allocated += size;
+  return mem;
+}
+
+void LoxHeap::release(void *mem, size_t size) {
+  size = round_up(size);
+  if (size > MAX_SMALL) {
+    char *block = static_cast<char *>(mem) - LARGE_PREFIX;
+    auto *header = reinterpret_cast<LargeHeader *>(block);
+    if (header->region != nullptr) {
+      header->region->live_objects--;
+      header->region->large[header->slot] = nullptr;
+    }
+    ::operator delete(block);
+    return;
+  }
+  POISON(mem, size);
+  Chunk *chunk = chunk_of(mem);
+  if (chunk->region != nullptr) {
+    chunk->region->live_objects--;
+    release_in_region(chunk, chunk->region->chunks);
+    return;
+  }
+  chunk->live_objects--;
+  chunk->live_bytes -= size;
+  if (chunk == nursery && static_cast<char *>(mem) + size == chunk->top) {
+    // The last thing the nursery handed out, whose space it can just bump
+    // out again
+    chunk->top -= size;
+    return;
+  }
+  push_free(mem, size);
+  // The nursery is reused right away, old chunks wait for the next sweep
+  if (chunk == nursery && chunk->live_objects == 0) {
+    forget_free(chunk);
+    reset(chunk);
+    heap_stats.nursery_resets++;
+  }
+}
+
+LoxHeap::Region::Region() : previous(current_region) {
+  current_region = this;
+}
+
+LoxHeap::Region::~Region() {
+  current_region = this->previous;
+  Chunk *chunk = this->chunks;
+  while (chunk != nullptr) {
+    Chunk *next = chunk->next;
+    free_chunk(chunk);
+    chunk = next;
+  }
+  for (void *block : this->large) {
+    ::operator delete(block);
+  }
+  heap_stats.regions++;
+  heap_stats.region_bytes += this->bytes;
+  heap_stats.region_objects += this->objects;
+  heap_stats.region_leaks += this->live_objects;
+}
+
+LoxHeap::Outside::Outside() : suspended(current_region) {
+  current_region = nullptr;
+}
+
+LoxHeap::Outside::~Outside() {
+  current_region = this->suspended;
+}
+
+const LoxHeap::Stats &LoxHeap::stats() { return heap_stats; }
+
+void LoxHeap::report(std::ostream &out) {
+  const Stats &s = heap_stats;
+  out << "gc: " << s.small_allocations << " nursery allocations (" << s.bytes_allocated
+      << " bytes), " << s.large_allocations << " large" << std::endl;
+  out << "gc: " << s.nursery_resets << " nursery resets, " << s.chunks_tenured
+      << " chunks tenured, " << s.bytes_promoted << " bytes promoted" << std::endl;
+  out << "gc: " << s.bytes_reused << " bytes allocated in the space of dead objects, "
+      << s.free_bytes << " bytes of it free at the end" << std::endl;
+  out << "gc: " << s.sweeps << " sweeps reclaimed " << s.chunks_swept << " chunks, pauses "
+      << s.total_pause_us << "us total, " << s.max_pause_us << "us max" << std::endl;
+  if (s.regions != 0) {
+    out << "gc: " << s.regions << " regions, " << s.region_objects << " objects ("
+        << s.region_bytes << " bytes) allocated from them, " << s.region_leaks
+        << " still referenced at the end" << std::endl;
+  }
+  out << "gc: " << s.chunks_in_use << " chunks of " << LoxHeap::CHUNK_SIZE << " bytes held, "
+      << s.max_chunks_in_use << " at most" << std::endl;
+}
@@ -0,0 +1,106 @@
+#ifndef HEAP_H_
+#define HEAP_H_
+
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+/* Where Lox heap objects (strings, rope nodes, functions) live.
+ *
+ * Reference counting decides when an object dies, the heap only decides
+ * where objects go and how the space of dead ones is used again. Nothing is
+ * traced or marked.
+ *
+ * Small objects are bump-allocated in a nursery chunk. Every chunk counts
+ * the objects still alive in it, and the nursery starts over as soon as all
+ * of them have died. When it's full, it is tenured with its survivors (the
+ * bytes promoted) and a fresh chunk takes its place. The block of an object
+ * that dies goes on the free list for its size, whatever chunk it's in, and
+ * allocation takes a block of the same size, or splits a bigger one, before
+ * bumping the nursery. A long-lived object thus only holds on to its own
+ * block, not to the chunk around it. Neighbouring free blocks aren't merged,
+ * so space that small objects gave back only goes to objects as small. Old
+ * chunks whose objects have all died are taken back whole when we run out
+ * of free chunks.
+ *
+ * Objects are never moved, C++ code holds plain pointers to them. Objects
+ * larger than MAX_SMALL go to operator new.
+ *
+ * An embedder running many short scripts can give each run a Region: while
+ * one is alive, every allocation is bumped out of the region's own chunks
+ * with nothing but a count per chunk, freeing only gives back chunks that
+ * emptied, and destroying the region gives all of its memory back at once
+ * without looking at a single object. */
+class LoxHeap {
+public:
+  struct Chunk;
+
+  static constexpr size_t CHUNK_SIZE = 64 * 1024;
+  static constexpr size_t MAX_SMALL = 1024;
+
+  struct Stats {
+    long small_allocations = 0;
+    long large_allocations = 0;
+    size_t bytes_allocated = 0;
+    long nursery_resets = 0;
+    long chunks_tenured = 0;
+    size_t bytes_promoted = 0;
+    size_t bytes_reused = 0;
+    // Held by dead objects' blocks, waiting to be reused
+    size_t free_bytes = 0;
+    long sweeps = 0;
+    long chunks_swept = 0;
+    double total_pause_us = 0;
+    double max_pause_us = 0;
+    long chunks_in_use = 0;
+    long max_chunks_in_use = 0;
+    long regions = 0;
+    size_t region_bytes = 0;
+    long region_objects = 0;
+    // Objects still referenced when their region went away, which is a bug
+    long region_leaks = 0;
+  };
+
+  /* Makes itself the place every allocation comes from, until it's
+   * destroyed (regions nest, the previous one comes back then). Everything
+   * allocated from the region has to be dead by then: a value the embedder
+   * wants to keep has to be copied out with LoxElement::escape first */
+  class Region {
+  private:
+    friend class LoxHeap;
+    Region *previous;
+    Chunk *chunks = nullptr;
+    // Blocks of the large objects, nullptr once released
+    std::vector<void *> large;
+    size_t bytes = 0;
+    long objects = 0;
+    long live_objects = 0;
+
+  public:
+    Region();
+    ~Region();
+    Region(const Region &) = delete;
+    Region &operator=(const Region &) = delete;
+  };
+
+  // Sends allocations back to the normal heap while it's alive, even inside
+  // a Region
+  class Outside {
+  private:
+    Region *suspended;
+
+  public:
+    Outside();
+    ~Outside();
+    Outside(const Outside &) = delete;
+    Outside &operator=(const Outside &) = delete;
+  };
+
+  static void *allocate(size_t size);
+  // "size" has to be what "mem" was allocated with
+  static void release(void *mem, size_t size);
+  static const Stats &stats();
+  static void report(std::ostream &out);
+};
+
+#endif // HEAP_H_
@@ -4,134 +4,289 @@
 #include <memory>
 #include <stdexcept>
 #include <vector>
+#include <charconv>
 #include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <sys/time.h>
 #include <time.h>
 
 #include "../util.hpp"
+#include "alloc_counter.hpp"
+#include "closure_compiler.hpp"
+#include "jit.hpp"
 #include "lox_function.hpp"
+#include "trace_jit.hpp"
 
 LoxElement::LoxElement(LoxTy _nil) {
     ASSERT_COND(
             _nil == LoxTy::LOX_NIL,
             "LoxElement nil constructor should only be called with LOX_NIL\n");
-    this->ty = LoxTy::LOX_NIL;
-    this->lox_nil = this->ty;
+    this->bits = NIL_BITS;
 }
 
-LoxElement::LoxElement(double num) {
-    this->ty = LoxTy::LOX_NUMBER;
-    this->lox_number = num;
-}
-
-LoxElement::LoxElement(bool b) {
-    this->ty = LoxTy::LOX_BOOL;
-    this->lox_bool = b;
-}
+LoxElement::LoxElement(std::string_view str) : LoxElement(LoxString::create(str)) {}
 
-LoxElement::LoxElement(std::string str) {
-    this->ty = LoxTy::LOX_STRING;
-    init_union_field(this->lox_str, std::string, std::move(str));
-}
+LoxElement::LoxElement(LoxCallable *callable) : LoxElement(static_cast<LoxHeapObj *>(callable)) {}
 
-LoxElement::LoxElement(LoxCallable *callable) : callable(std::shared_ptr<LoxCallable>(callable)) {
-    this->ty = LoxTy::LOX_CALLABLE;
-}
+LoxElement LoxElement::nil() { return LoxElement(LoxTy::LOX_NIL); }
 
-LoxElement::LoxElement(LoxElement &&to_move) : ty(to_move.ty) {
-    switch (to_move.ty) {
-        case LoxTy::LOX_NUMBER:
-            this->lox_number = to_move.lox_number;
-            break;
+void LoxElement::release() {
+    LoxHeapObj *obj = as_obj();
+    this->bits = NIL_BITS;
+    if (--obj->refs != 0) {
+        return;
+    }
+    switch (obj->ty) {
         case LoxTy::LOX_STRING:
-            init_union_field(this->lox_str, std::string, std::move(to_move.lox_str));
-            break;
-        case LoxTy::LOX_NIL:
-            this->lox_nil = LoxTy::LOX_NIL;
-            break;
-        case LoxTy::LOX_BOOL:
-            this->lox_number = to_move.lox_number;
+            LoxString::destroy(static_cast<LoxString *>(obj));
             break;
         case LoxTy::LOX_CALLABLE:
-            init_union_field(this->callable, std::shared_ptr < LoxCallable >, std::move(to_move.callable));
-            break;
-        case LoxTy::LOX_OBJ:
+            LoxCallable::destroy(static_cast<LoxCallable *>(obj));
             break;
         default:
             std::cerr << "Unknown LoxElement type. This should never happen"
                       << std::endl;
+            break;
     }
 }
 
-LoxElement LoxElement::nil() { return LoxElement(LoxTy::LOX_NIL); }
+LoxString *LoxString::alloc(size_t len) {
+    void *mem = LoxHeap::allocate(sizeof(LoxString) + len + 1);
+    auto *str = ::new (mem) LoxString(len);
+    str->inline_chars()[len] = '\0';
+    return str;
+}
 
-LoxElement::~LoxElement() {
-    switch (this->ty) {
-        case LoxTy::LOX_STRING:
-            std::destroy_at(&this->lox_str);
-            break;
-        case LoxTy::LOX_CALLABLE:
-            std::destroy_at(&this->callable);
-            break;
-        case LoxTy::LOX_OBJ:
-        case LoxTy::LOX_BOOL:
-        case LoxTy::LOX_NUMBER:
-        case LoxTy::LOX_NIL:
-            break;
-        default:
-            std::cerr << "Unknown LoxElement type. This should never happen"
-                      << std::endl;
-            break;
+LoxString *LoxString::create(std::string_view chars) {
+    LoxString *str = alloc(chars.size());
+    std::memcpy(str->inline_chars(), chars.data(), chars.size());
+    return str;
+}
+
+LoxString *LoxString::flat_concat(const LoxString &left, const LoxString &right) {
+    LoxString *str = alloc(left.len + right.len);
+    std::memcpy(str->inline_chars(), left.chars(), left.len);
+    std::memcpy(str->inline_chars() + left.len, right.chars(), right.len);
+    return str;
+}
+
+LoxString *LoxString::join(LoxString *left, LoxString *right) {
+    void *mem = LoxHeap::allocate(sizeof(LoxString));
+    auto *str = ::new (mem) LoxString(left->len + right->len);
+    str->data = nullptr;
+    str->left = left;
+    str->right = right;
+    str->depth = 1 + std::max(left->depth, right->depth);
+    return str;
+}
+
+LoxString *LoxString::rope(LoxString *left, LoxString *right) {
+    LoxString *str = join(left, right);
+    if (str->depth > MAX_ROPE_DEPTH) {
+        return rebalance(str);
     }
+    return str;
 }
 
-LoxElement &LoxElement::operator=(LoxElement &&to_move) {
-    switch (this->ty) {
-        case LoxTy::LOX_STRING:
-            std::destroy_at(&this->lox_str);
-            break;
-        case LoxTy::LOX_CALLABLE:
-            std::destroy_at(&this->callable);
-            break;
-        case LoxTy::LOX_OBJ:
-        case LoxTy::LOX_BOOL:
-        case LoxTy::LOX_NUMBER:
-        case LoxTy::LOX_NIL:
-            break;
-        default:
-            std::cerr << "Unknown LoxElement type. This should never happen"
-                      << std::endl;
-            break;
+LoxString *LoxString::concat(LoxString &left, LoxString &right) {
+    size_t len = left.len + right.len;
+    if (StringTable::should_intern(len)) {
+        return StringTable::intern(flat_concat(left, right));
+    }
+    if (!left.is_rope() && !right.is_rope() && len <= ROPE_LEAF_MAX) {
+        return flat_concat(left, right);
     }
+    // Appending a short piece: copy it into a new last leaf, rather than
+    // growing the rope by one level for every piece
+    if (left.is_rope() && !right.is_rope() && !left.right->is_rope() &&
+        left.right->len + right.len <= ROPE_LEAF_MAX) {
+        return rope(left.left->retain(), flat_concat(*left.right, right));
+    }
+    return rope(left.retain(), right.retain());
+}
 
-    switch (to_move.ty) {
-        case LoxTy::LOX_STRING:
-            this->lox_str = std::move(to_move.lox_str);
-            break;
-        case LoxTy::LOX_OBJ:
-        case LoxTy::LOX_BOOL:
-            this->lox_bool = to_move.lox_bool;
-            break;
-        case LoxTy::LOX_NUMBER:
-            this->lox_number = to_move.lox_number;
-            break;
-        case LoxTy::LOX_NIL:
-            this->lox_nil = LoxTy::LOX_NIL;
-            break;
-        case LoxTy::LOX_CALLABLE:
-            init_union_field(this->callable, std::shared_ptr < LoxCallable >, std::move(to_move.callable));
-            break;
-        default:
-            std::cerr << "Unknown LoxElement type. This should never happen"
-                      << std::endl;
-            break;
+void LoxString::collect_leaves(LoxString *str, std::vector<LoxString *> &leaves) {
+    if (!str->is_rope()) {
+        leaves.push_back(str);
+        return;
+    }
+    collect_leaves(str->left, leaves);
+    collect_leaves(str->right, leaves);
+}
+
+// Takes a new reference to each of the leaves in [from, to)
+LoxString *LoxString::balanced(const std::vector<LoxString *> &leaves, size_t from, size_t to) {
+    if (to - from == 1) {
+        return leaves[from]->retain();
+    }
+    size_t mid = from + (to - from) / 2;
+    return join(balanced(leaves, from, mid), balanced(leaves, mid, to));
+}
+
+LoxString *LoxString::rebalance(LoxString *rope) {
+    std::vector<LoxString *> leaves;
+    collect_leaves(rope, leaves);
+    LoxString *result = balanced(leaves, 0, leaves.size());
+    release(rope);
+    return result;
+}
+
+void LoxString::flatten() const {
+    char *buf = new char[this->len + 1];
+    buf[this->len] = '\0';
+    // Leaves are copied right to left, walking the rope with our own stack
+    std::vector<const LoxString *> pending{this};
+    size_t end = this->len;
+    while (!pending.empty()) {
+        const LoxString *str = pending.back();
+        pending.pop_back();
+        if (str->data != nullptr) {
+            end -= str->len;
+            std::memcpy(buf + end, str->data, str->len);
+        } else {
+            pending.push_back(str->left);
+            pending.push_back(str->right);
+        }
+    }
+    this->data = buf;
+    release(this->left);
+    release(this->right);
+    this->left = nullptr;
+    this->right = nullptr;
+    this->depth = 0;
+}
+
+void LoxString::destroy(LoxString *str) {
+    if (str->interned) {
+        StringTable::remove(str);
+    }
+    if (str->is_rope()) {
+        release(str->left);
+        release(str->right);
+    } else if (str->data != str->inline_chars()) {
+        delete[] str->data;
+    }
+    size_t size = str->allocated_size();
+    str->~LoxString();
+    LoxHeap::release(str, size);
+}
+
+long StringTable::max_runtime_len = StringTable::DEFAULT_MAX_RUNTIME_LEN;
+
+struct FnvHash {
+    size_t operator()(std::string_view chars) const {
+        size_t hash = 14695981039346656037ull;
+        for (unsigned char c : chars) {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        return hash;
+    }
+};
+
+// Keyed by the interned string's own characters, which never change
+static std::unordered_map<std::string_view, LoxString *, FnvHash> &interned_strings() {
+    static std::unordered_map<std::string_view, LoxString *, FnvHash> table;
+    return table;
+}
+
+LoxString *StringTable::intern(std::string_view chars) {
+    auto &table = interned_strings();
+    auto found = table.find(chars);
+    if (found != table.end()) {
+        found->second->refs++;
+        return found->second;
+    }
+    LoxString *str = LoxString::create(chars);
+    str->interned = true;
+    str->hash();
+    table.emplace(str->view(), str);
+    return str;
+}
+
+LoxString *StringTable::intern(LoxString *fresh) {
+    auto &table = interned_strings();
+    auto found = table.find(fresh->view());
+    if (found != table.end()) {
+        LoxString::destroy(fresh);
+        found->second->refs++;
+        return found->second;
+    }
+    fresh->interned = true;
+    fresh->hash();
+    table.emplace(fresh->view(), fresh);
+    return fresh;
+}
+
+void StringTable::remove(LoxString *str) {
+    interned_strings().erase(str->view());
+}
+
+size_t StringTable::size() {
+    return interned_strings().size();
+}
+
+size_t LoxString::hash() const {
+    if (this->cached_hash == 0) {
+        // 0 means "not computed yet", so a string hashing to it is just
+        // rehashed every time
+        this->cached_hash = FnvHash{}(view());
     }
-    this->ty = to_move.ty;
-    return *this;
+    return this->cached_hash;
 }
 
-Interpreter::Interpreter() {
-    this->globals.define("clock", LoxElement(new NativeClockFn{}));
+bool LoxString::equals(const LoxString &other) const {
+    if (this == &other) {
+        return true;
+    }
+    if (this->interned && other.interned) {
+        return false;
+    }
+    if (this->len != other.len) {
+        return false;
+    }
+    // Only worth looking at hashes both sides already paid for
+    if (this->cached_hash != 0 && other.cached_hash != 0 && this->cached_hash != other.cached_hash) {
+        return false;
+    }
+    return std::memcmp(chars(), other.chars(), this->len) == 0;
+}
+
+static LoxElement native_clock(Interpreter *interp, std::span<LoxElement> args);
+static LoxElement native_allocations(Interpreter *interp, std::span<LoxElement> args);
+
+Interpreter::Interpreter(Engine engine) : engine(engine) {
+    this->globals.define("clock", LoxElement(new NativeFn(native_clock, 0)));
+    if (engine == Engine::ENGINE_CLOSURE) {
+        this->compiler = std::make_unique<ClosureCompiler>();
+    }
+}
+
+Interpreter::~Interpreter() {
+    for (auto *lit : this->interned_literals) {
+        LoxElement dropped{lit->interned};
+        lit->interned = nullptr;
+    }
+}
+
+void Interpreter::enable_jit(long threshold) {
+    if (Jit::supported()) {
+        this->jit = std::make_unique<Jit>(threshold);
+    }
+}
+
+void Interpreter::enable_trace_jit() {
+    if (TraceJit::supported() && this->engine == Engine::ENGINE_TREE) {
+        this->tracer = std::make_unique<TraceJit>();
+    }
+}
+
+JitFunction *Interpreter::jit_function_for(const FuncStmt *decl) {
+    if (this->jit == nullptr) {
+        return nullptr;
+    }
+    return this->jit->function_for(decl);
 }
 
 /*
@@ -155,14 +310,122 @@ LoxElement Interpreter::evaluate_literal(const Literal &literal) {
     }
 }
 
+LoxElement Interpreter::evaluate_literal_expr(const LiteralExpr &lit) {
+    if (lit.lit.ty != LiteralTy::LIT_STRING) {
+        return evaluate_literal(lit.lit);
+    }
+    // Only code that didn't go through interpret() gets here unresolved
+    if (lit.interned == nullptr) {
+        intern_literal(lit);
+    }
+    return LoxElement(lit.interned->retain());
+}
+
+void Interpreter::intern_literal(const LiteralExpr &lit) {
+    lit.interned = StringTable::intern(lit.lit.str);
+    this->interned_literals.push_back(&lit);
+}
+
+void Interpreter::resolve_literals(const std::vector<Stmt> &statements) {
+    // Iterative, long operator chains nest deeper than the C++ stack allows
+    std::vector<const Stmt *> stmts;
+    std::vector<const Expr *> exprs;
+    for (auto &stmt : statements) {
+        stmts.push_back(&stmt);
+    }
+    while (!stmts.empty() || !exprs.empty()) {
+        if (!stmts.empty()) {
+            const Stmt &stmt = *stmts.back();
+            stmts.pop_back();
+            switch (stmt.ty) {
+                case StmtTy::STMT_EXPR:
+                    exprs.push_back(&stmt.expression.expr);
+                    break;
+                case StmtTy::STMT_PRINT:
+                    exprs.push_back(&stmt.print.expr);
+                    break;
+                case StmtTy::STMT_VAR:
+                    exprs.push_back(&stmt.var.initializer);
+                    break;
+                case StmtTy::STMT_BLOCK:
+                    for (auto &inner : stmt.block.statements) {
+                        stmts.push_back(&inner);
+                    }
+                    break;
+                case StmtTy::STMT_IF:
+                    exprs.push_back(&stmt.if_stmt.condition);
+                    stmts.push_back(stmt.if_stmt.then_branch);
+                    if (stmt.if_stmt.else_branch != nullptr) {
+                        stmts.push_back(stmt.if_stmt.else_branch);
+                    }
+                    break;
+                case StmtTy::STMT_WHILE:
+                    exprs.push_back(&stmt.while_stmt.cond);
+                    stmts.push_back(stmt.while_stmt.body);
+                    break;
+                case StmtTy::STMT_FUNC:
+                    for (auto &inner : stmt.func_stmt->body.statements) {
+                        stmts.push_back(&inner);
+                    }
+                    break;
+                case StmtTy::STMT_RETURN:
+                    exprs.push_back(&stmt.return_stmt.value);
+                    break;
+            }
+            continue;
+        }
+        const Expr &expr = *exprs.back();
+        exprs.pop_back();
+        switch (expr.ty) {
+            case ExprTy::BINARY:
+                exprs.push_back(expr.bin.left);
+                exprs.push_back(expr.bin.right);
+                break;
+            case ExprTy::UNARY:
+                exprs.push_back(expr.unary.right);
+                break;
+            case ExprTy::GROUPING:
+                exprs.push_back(expr.group.expression);
+                break;
+            case ExprTy::LITERAL:
+                if (expr.lit.lit.ty == LiteralTy::LIT_STRING && expr.lit.interned == nullptr) {
+                    intern_literal(expr.lit);
+                }
+                break;
+            case ExprTy::VAR_EXPR:
+                break;
+            case ExprTy::ASSIGN_EXPR:
+                exprs.push_back(expr.ass_expr.value);
+                break;
+            case ExprTy::LOGICAL_EXPR:
+                exprs.push_back(expr.logical.left);
+                exprs.push_back(expr.logical.right);
+                break;
+            case ExprTy::CALL_EXPR:
+                exprs.push_back(expr.call.callee);
+                for (auto &arg : expr.call.args) {
+                    exprs.push_back(&arg);
+                }
+                break;
+        }
+    }
+}
+
 LoxElement Interpreter::evaluate_unary_expr(const UnaryExpr &unary) {
-    auto right = evaluate(*unary.right);
+    return apply_unary(unary, evaluate(*unary.right));
+}
+
+LoxElement Interpreter::apply_unary(const UnaryExpr &unary, LoxElement right) {
     switch (unary.op.type) {
         case TokenType::MINUS:
-            check_number_operand(unary.op, right);
+            if (!check_number_operand(unary.op, right)) {
+                return LoxElement::nil();
+            }
             return LoxElement(-right.as_number());
         case TokenType::BANG:
-            check_bool_operand(unary.op, right);
+            if (!check_bool_operand(unary.op, right)) {
+                return LoxElement::nil();
+            }
             return LoxElement(!right.is_truthy());
             break;
         default:
@@ -188,32 +451,31 @@ LoxElement Interpreter::evaluate_logical_expr(const LogicalExpr &logical) {
     return evaluate(*logical.right);
 }
 
-bool LoxElement::is_number() const { return is_instance_of(LoxTy::LOX_NUMBER); }
 
 double LoxElement::as_number() const {
-    if (this->ty == LoxTy::LOX_NUMBER) {
-        return this->lox_number;
+    if (is_number()) {
+        return this->lox_number();
     }
     throw std::runtime_error("LoxElement isn't a number!");
 }
 
-bool LoxElement::equals(const LoxElement &other) {
+bool LoxElement::equals(const LoxElement &other) const {
     if (is_nil() && other.is_nil()) {
         return true;
     } // Two nils are equal
     if (is_nil() || other.is_nil()) {
         return false;
     } // If only one of them is nil, they are not equal
-    if (this->ty != other.ty) {
+    if (this->ty() != other.ty()) {
         return false;
     }
-    switch (this->ty) {
+    switch (this->ty()) {
         case LoxTy::LOX_NUMBER:
-            return this->lox_number == other.lox_number;
+            return this->lox_number() == other.lox_number();
         case LoxTy::LOX_BOOL:
-            return this->lox_bool == other.lox_bool;
+            return this->lox_bool() == other.lox_bool();
         case LoxTy::LOX_STRING:
-            return this->lox_str == other.lox_str;
+            return as_string()->equals(*other.as_string());
         case LoxTy::LOX_OBJ:
             // TODO
             return false;
@@ -224,25 +486,169 @@ bool LoxElement::equals(const LoxElement &other) {
     }
 }
 
+static bool numbers(const LoxElement &left, const LoxElement &right) {
+    return left.is_number() && right.is_number();
+}
+
 LoxElement Interpreter::evaluate_binary_expr(const BinaryExpr &binary) {
     auto left = evaluate(*binary.left);
     auto right = evaluate(*binary.right);
+    return apply_binary(binary, left, right);
+}
 
+LoxElement Interpreter::apply_binary(const BinaryExpr &binary, const LoxElement &left,
+                                     const LoxElement &right) {
+    // A specialized node skips the operator dispatch and the generic checks,
+    // if its operands still have the types it specialized on
+    switch (binary.spec) {
+        case BinarySpec::SPEC_UNINITIALIZED:
+            specialize(binary, left, right);
+            break;
+        case BinarySpec::SPEC_NUM_ADD:
+            if (numbers(left, right)) {
+                return LoxElement(left.lox_number() + right.lox_number());
+            }
+            despecialize(binary);
+            break;
+        case BinarySpec::SPEC_NUM_SUB:
+            if (numbers(left, right)) {
+                return LoxElement(left.lox_number() - right.lox_number());
+            }
+            despecialize(binary);
+            break;
+        case BinarySpec::SPEC_NUM_MUL:
+            if (numbers(left, right)) {
+                return LoxElement(left.lox_number() * right.lox_number());
+            }
+            despecialize(binary);
+            break;
+        case BinarySpec::SPEC_NUM_DIV:
+            if (numbers(left, right)) {
+                if (right.lox_number() == 0.0) {
+                    raise(binary.op, "Cannot divide by zero");
+                    return LoxElement::nil();
+                }
+                return LoxElement(left.lox_number() / right.lox_number());
+            }
+            despecialize(binary);
+            break;
+        case BinarySpec::SPEC_NUM_GREATER:
+            if (numbers(left, right)) {
+                return LoxElement(left.lox_number() > right.lox_number());
+            }
+            despecialize(binary);
+            break;
+        case BinarySpec::SPEC_NUM_GREATER_EQUAL:
+            if (numbers(left, right)) {
+                return LoxElement(left.lox_number() >= right.lox_number());
+            }
+            despecialize(binary);
+            break;
+        case BinarySpec::SPEC_NUM_LESS:
+            if (numbers(left, right)) {
+                return LoxElement(left.lox_number() < right.lox_number());
+            }
+            despecialize(binary);
+            break;
+        case BinarySpec::SPEC_NUM_LESS_EQUAL:
+            if (numbers(left, right)) {
+                return LoxElement(left.lox_number() <= right.lox_number());
+            }
+            despecialize(binary);
+            break;
+        case BinarySpec::SPEC_NUM_EQUAL:
+            if (numbers(left, right)) {
+                return LoxElement(left.lox_number() == right.lox_number());
+            }
+            despecialize(binary);
+            break;
+        case BinarySpec::SPEC_NUM_NOT_EQUAL:
+            if (numbers(left, right)) {
+                return LoxElement(left.lox_number() != right.lox_number());
+            }
+            despecialize(binary);
+            break;
+        case BinarySpec::SPEC_STR_CONCAT:
+            if (left.ty() == LoxTy::LOX_STRING && right.ty() == LoxTy::LOX_STRING) {
+                return LoxElement(LoxString::concat(*left.as_string(), *right.as_string()));
+            }
+            despecialize(binary);
+            break;
+        default:
+            break;
+    }
+    return evaluate_binary_op(binary, left, right);
+}
+
+void Interpreter::specialize(const BinaryExpr &binary, const LoxElement &left,
+                             const LoxElement &right) {
+    BinarySpec spec = BinarySpec::SPEC_GENERIC;
+    if (numbers(left, right)) {
+        switch (binary.op.type) {
+            case TokenType::PLUS: spec = BinarySpec::SPEC_NUM_ADD; break;
+            case TokenType::MINUS: spec = BinarySpec::SPEC_NUM_SUB; break;
+            case TokenType::STAR: spec = BinarySpec::SPEC_NUM_MUL; break;
+            case TokenType::SLASH: spec = BinarySpec::SPEC_NUM_DIV; break;
+            case TokenType::GREATER: spec = BinarySpec::SPEC_NUM_GREATER; break;
+            case TokenType::GREATER_EQUAL: spec = BinarySpec::SPEC_NUM_GREATER_EQUAL; break;
+            case TokenType::LESS: spec = BinarySpec::SPEC_NUM_LESS; break;
+            case TokenType::LESS_EQUAL: spec = BinarySpec::SPEC_NUM_LESS_EQUAL; break;
+            case TokenType::EQUAL_EQUAL: spec = BinarySpec::SPEC_NUM_EQUAL; break;
+            case TokenType::BANG_EQUAL: spec = BinarySpec::SPEC_NUM_NOT_EQUAL; break;
+            default: break;
+        }
+    } else if (binary.op.type == TokenType::PLUS && left.ty() == LoxTy::LOX_STRING &&
+               right.ty() == LoxTy::LOX_STRING) {
+        spec = BinarySpec::SPEC_STR_CONCAT;
+    }
+    binary.spec = spec;
+    if (spec != BinarySpec::SPEC_GENERIC) {
+        this->spec_stats.specializations[spec]++;
+    }
+}
+
+void Interpreter::despecialize(const BinaryExpr &binary) {
+    this->spec_stats.despecializations[binary.spec]++;
+    // Going generic for good keeps a polymorphic node from flip-flopping
+    binary.spec = BinarySpec::SPEC_GENERIC;
+}
+
+void SpecStats::report(std::ostream &out) const {
+    static const char *names[BinarySpec::SPEC_COUNT] = {
+        nullptr, nullptr, "num +", "num -", "num *", "num /", "num >", "num >=",
+        "num <", "num <=", "num ==", "num !=", "str +"
+    };
+    for (int spec = BinarySpec::SPEC_NUM_ADD; spec < BinarySpec::SPEC_COUNT; spec++) {
+        out << "spec: " << names[spec] << "\t" << this->specializations[spec]
+            << " specialized, " << this->despecializations[spec] << " de-specialized"
+            << std::endl;
+    }
+}
+
+LoxElement Interpreter::evaluate_binary_op(const BinaryExpr &binary, const LoxElement &left,
+                                           const LoxElement &right) {
     switch (binary.op.type) {
         case TokenType::MINUS:
             // Perform binop on exprs and check that they are the right type
-            check_number_operands(binary.op, left, right);
+            if (!check_number_operands(binary.op, left, right)) {
+                return LoxElement::nil();
+            }
             return LoxElement(left.as_number() - right.as_number());
         case TokenType::SLASH:
             // Perform binop on exprs and check that they are the right type
-            check_number_operands(binary.op, left, right);
+            if (!check_number_operands(binary.op, left, right)) {
+                return LoxElement::nil();
+            }
             if (right.as_number() == 0.0) {
-                throw DivisionByZeroErr{binary.op.clone(), "Cannot divide by zero"};
+                raise(binary.op, "Cannot divide by zero");
+                return LoxElement::nil();
             }
             return LoxElement(left.as_number() / right.as_number());
         case TokenType::STAR:
             // Perform binop on exprs and check that they are the right type
-            check_number_operands(binary.op, left, right);
+            if (!check_number_operands(binary.op, left, right)) {
+                return LoxElement::nil();
+            }
             return LoxElement(left.as_number() * right.as_number());
         case TokenType::PLUS:
             if (left.is_number() && right.is_number()) {
@@ -250,22 +656,29 @@ LoxElement Interpreter::evaluate_binary_expr(const BinaryExpr &binary) {
             }
             if (left.is_instance_of(LoxTy::LOX_STRING) &&
                 right.is_instance_of(LoxTy::LOX_STRING)) {
-                std::string res = left.lox_str;
-                res += right.lox_str;
-                return LoxElement(std::move(res));
+                return LoxElement(LoxString::concat(*left.as_string(), *right.as_string()));
             }
-            throw LoxRuntimeErr{binary.op.clone(), "Operation '+' exists only on numbers and strings"};
+            raise(binary.op, "Operation '+' exists only on numbers and strings");
+            return LoxElement::nil();
         case TokenType::GREATER:
-            check_number_operands(binary.op, left, right);
+            if (!check_number_operands(binary.op, left, right)) {
+                return LoxElement::nil();
+            }
             return LoxElement(left.as_number() > right.as_number());
         case TokenType::GREATER_EQUAL:
-            check_number_operands(binary.op, left, right);
+            if (!check_number_operands(binary.op, left, right)) {
+                return LoxElement::nil();
+            }
             return LoxElement(left.as_number() >= right.as_number());
         case TokenType::LESS:
-            check_number_operands(binary.op, left, right);
+            if (!check_number_operands(binary.op, left, right)) {
+                return LoxElement::nil();
+            }
             return LoxElement(left.as_number() < right.as_number());
         case TokenType::LESS_EQUAL:
-            check_number_operands(binary.op, left, right);
+            if (!check_number_operands(binary.op, left, right)) {
+                return LoxElement::nil();
+            }
             return LoxElement(left.as_number() <= right.as_number());
         case TokenType::BANG_EQUAL:
             return !left.equals(right);
@@ -288,13 +701,15 @@ bool Interpreter::check_number_operand(const Token &tok,
     if (right.is_number()) {
         return true;
     }
-    throw LoxRuntimeErr{tok.clone(), "Operand must be a number."};
+    raise(tok, "Operand must be a number.");
+    return false;
 }
 
 bool Interpreter::check_bool_operand(const Token &tok,
                                      const LoxElement &right) {
-    if (right.ty != LoxTy::LOX_BOOL) {
-        throw LoxRuntimeErr{tok.clone(), "Operand must be a boolean."};
+    if (right.ty() != LoxTy::LOX_BOOL) {
+        raise(tok, "Operand must be a boolean.");
+        return false;
     }
     return true;
 }
@@ -302,45 +717,64 @@ bool Interpreter::check_bool_operand(const Token &tok,
 bool Interpreter::check_number_operands(const Token &tok,
                                         const LoxElement &left,
                                         const LoxElement &right) {
-    if (left.ty != LoxTy::LOX_NUMBER || right.ty != LoxTy::LOX_NUMBER) {
-        throw LoxRuntimeErr{tok.clone(), "Operand must be a number."};
+    if (!left.is_number() || !right.is_number()) {
+        raise(tok, "Operand must be a number.");
+        return false;
     }
     return true;
 }
 
-bool LoxElement::is_instance_of(LoxTy ty) const { return this->ty == ty; }
+bool LoxElement::is_instance_of(LoxTy ty) const { return this->ty() == ty; }
 
-bool LoxElement::is_nil() const { return this->ty == LoxTy::LOX_NIL; }
 
 bool LoxElement::is_truthy() const {
-    if (is_instance_of(LoxTy::LOX_BOOL)) {
-        return this->lox_bool;
-    }
-    if (is_nil()) {
-        return false;
-    }
-    return true;
+    return this->bits != FALSE_BITS && this->bits != NIL_BITS;
 }
 
 bool LoxElement::is_callable() const {
-    return this->ty == LoxTy::LOX_CALLABLE;
+    return this->ty() == LoxTy::LOX_CALLABLE;
+}
+
+size_t LoxElement::format_number(double num, char *out) {
+    char *end = out + NUMBER_CHARS;
+    char *p = out;
+    if (num == std::trunc(num) && std::fabs(num) < 1e15) {
+        if (std::signbit(num)) {
+            *p++ = '-';
+        }
+        return std::to_chars(p, end, static_cast<long long>(std::fabs(num))).ptr - out;
+    }
+    if (!std::isfinite(num)) {
+        return std::to_chars(p, end, num).ptr - out;
+    }
+    // The shortest round-trip digits decide the precision, %g decides the
+    // notation, so the output does not depend on which of the two is shorter
+    char *sci_end = std::to_chars(p, end, num, std::chars_format::scientific).ptr;
+    int digits = 0;
+    for (char *c = p; c < sci_end && *c != 'e'; c++) {
+        digits += *c >= '0' && *c <= '9';
+    }
+    return std::to_chars(p, end, num, std::chars_format::general, digits).ptr - out;
 }
 
 std::string LoxElement::stringify() const {
-    switch (this->ty) {
+    switch (this->ty()) {
         case LoxTy::LOX_STRING:
-            return this->lox_str;
+            return std::string(this->lox_str());
         case LoxTy::LOX_NUMBER:
-            return std::to_string(this->lox_number);
+        {
+            char buf[NUMBER_CHARS];
+            return std::string(buf, format_number(this->lox_number(), buf));
+        }
         case LoxTy::LOX_BOOL:
-            if (this->lox_bool) {
+            if (this->lox_bool()) {
                 return "true";
             }
             return "false";
         case LoxTy::LOX_NIL:
             return "nil";
         case LoxTy::LOX_CALLABLE:
-            return this->callable->to_string();
+            return this->callable()->to_string();
         case LoxTy::LOX_OBJ:
             UNREACHABLE();
         default:
@@ -349,42 +783,99 @@ std::string LoxElement::stringify() const {
 }
 
 
-LoxElement &Interpreter::evaluate_variable_expr(const VariableExpr &var) {
-    if (this->globals.contains(var.name)) {
-        return this->globals.get(var.name);
+[[gnu::cold]] static std::string undefined_variable(const Token &name) {
+    std::string err = "Undefined variable '";
+    err += name.lexeme;
+    err += "'.";
+    return err;
+}
+
+// What reading an undefined variable evaluates to, while the error propagates
+static const LoxElement undefined = LoxElement::nil();
+
+const LoxElement &Interpreter::evaluate_variable_expr(const VariableExpr &var) {
+    LoxElement *global = this->globals.find(var.name.lexeme);
+    if (global != nullptr) {
+        return *global;
     }
-    return this->env.get(var.name);
+    LoxElement *local = this->locals.find(var.name.lexeme);
+    if (local == nullptr) {
+        raise(var.name, undefined_variable(var.name));
+        return undefined;
+    }
+    return *local;
 }
 
 LoxElement Interpreter::evaluate_assign_expr(const AssignExpr &assign) {
-    auto value = evaluate(*assign.value);
-    this->env.assign(assign.name.clone(), std::move(value));
-    return value.copy();
+    return assign_value(assign, evaluate(*assign.value));
+}
+
+LoxElement Interpreter::assign_value(const AssignExpr &assign, LoxElement value) {
+    // An assignment has always evaluated to what moving the value into the
+    // variable left behind: the same number or boolean, but an empty string
+    LoxElement result = value.ty() == LoxTy::LOX_STRING ? LoxElement(StringTable::intern(std::string_view{}))
+                                                        : value.copy();
+    if (!this->locals.assign(assign.name, std::move(value))) {
+        raise(assign.name, undefined_variable(assign.name));
+        return LoxElement::nil();
+    }
+    return result;
 }
 
 LoxElement Interpreter::evaluate_call_expr(const CallExpr &call) {
     auto callee = evaluate(*call.callee);
-    std::vector <LoxElement> args{};
+    size_t first_arg = this->locals.size();
     for (auto &arg : call.args) {
-        args.push_back(evaluate(arg));
+        push_arg(call.paren, evaluate(arg));
+    }
+    return call_value(call.paren, callee, first_arg);
+}
+
+void Interpreter::push_arg(const Token &paren, LoxElement arg) {
+    if (!this->locals.push_arg(std::move(arg))) {
+        raise(paren, "Stack overflow.");
+    }
+}
+
+LoxElement Interpreter::call_value(const Token &paren, const LoxElement &callee, size_t first_arg) {
+    struct PopArgs {
+        ValueStack &stack;
+        size_t first_arg;
+        ~PopArgs() { this->stack.truncate(this->first_arg); }
+    } pop_args{this->locals, first_arg};
+    // The callee or an argument raised an error, nothing may run anymore
+    if (failed()) {
+        return LoxElement::nil();
     }
     if (!callee.is_callable()) {
-        throw LoxRuntimeErr(call.paren.clone(), "Can only call functions and classes.");
+        raise(paren, "Can only call functions and classes.");
+        return LoxElement::nil();
     }
-    auto &callable = *callee.callable;
-    int arity;
-    if (args.size() != (arity = callable.arity())) {
+    auto *callable = callee.callable();
+    int arity = callable->arity();
+    size_t argc = this->locals.size() - first_arg;
+    if (argc != arity) {
         std::string err = "Expected ";
         err += arity;
         err += " arguments but got ";
-        err += args.size();
+        err += argc;
         err += '.';
-        throw LoxRuntimeErr(call.paren.clone(), err);
+        raise(paren, std::move(err));
+        return LoxElement::nil();
     }
-    return callable.call(this, std::move(args));
+    switch (callable->kind) {
+        case CallableKind::USER_FN:
+            return static_cast<LoxFunction *>(callable)->call(this, first_arg);
+        case CallableKind::NATIVE_FN:
+            return static_cast<NativeFn *>(callable)->code(this, this->locals.args(first_arg));
+    }
+    UNREACHABLE();
 }
 
 LoxElement Interpreter::evaluate(const Expr &expr) {
+    if (this->stack_eval) {
+        return evaluate_iteratively(expr);
+    }
     switch (expr.ty) {
         case ExprTy::BINARY:
             return evaluate_binary_expr(expr.bin);
@@ -393,7 +884,7 @@ LoxElement Interpreter::evaluate(const Expr &expr) {
         case ExprTy::GROUPING:
             return evaluate_grouping_expr(expr.group);
         case ExprTy::LITERAL:
-            return evaluate_literal(expr.lit.lit);
+            return evaluate_literal_expr(expr.lit);
         case ExprTy::VAR_EXPR:
             // NOTE: is this right? Potentially we need to worry if the expr is a heap-allocated object.
             // Should we use shared_ptr for that?
@@ -412,136 +903,390 @@ LoxElement Interpreter::evaluate(const Expr &expr) {
 }
 
 
-void Interpreter::run_print_stmt(const Print &print) {
-    auto returned = evaluate(print.expr);
-    std::cout << returned.stringify() << std::endl;
+// The token runtime errors in "expr" are reported at, nullptr for literals and
+// groupings
+static const Token *expr_token(const Expr &expr) {
+    switch (expr.ty) {
+        case ExprTy::BINARY:
+            return &expr.bin.op;
+        case ExprTy::UNARY:
+            return &expr.unary.op;
+        case ExprTy::VAR_EXPR:
+            return &expr.var_expr.name;
+        case ExprTy::ASSIGN_EXPR:
+            return &expr.ass_expr.name;
+        case ExprTy::LOGICAL_EXPR:
+            return &expr.logical.op;
+        case ExprTy::CALL_EXPR:
+            return &expr.call.paren;
+        default:
+            return nullptr;
+    }
+}
+
+void Interpreter::enable_stack_eval(size_t max_depth) {
+    this->stack_eval = true;
+    this->max_eval_depth = max_depth;
+}
+
+void Interpreter::enable_alloc_counter() {
+    this->globals.define("allocations", LoxElement(new NativeFn(native_allocations, 0)));
+}
+
+void Interpreter::push_eval_frame(const Expr &expr) {
+    // Leaves don't need a frame, they're evaluated on the spot
+    if (expr.ty == ExprTy::LITERAL) {
+        this->eval_operands.push_back(evaluate_literal_expr(expr.lit));
+        return;
+    }
+    if (expr.ty == ExprTy::VAR_EXPR) {
+        this->eval_operands.push_back(evaluate_variable_expr(expr.var_expr).copy());
+        return;
+    }
+    if (this->eval_frames.size() >= this->max_eval_depth) {
+        // Reported at the innermost expression that has a token
+        const Token *where = expr_token(expr);
+        for (auto it = this->eval_frames.rbegin(); where == nullptr && it != this->eval_frames.rend(); it++) {
+            where = expr_token(*it->expr);
+        }
+        Token paren = Token(TokenType::LEFT_PAREN, "(", None, 0);
+        raise(where != nullptr ? *where : paren, "Expression nested too deeply.");
+        return;
+    }
+    this->eval_frames.push_back(EvalFrame{&expr, 0});
+}
+
+LoxElement Interpreter::pop_operand() {
+    LoxElement value = std::move(this->eval_operands.back());
+    this->eval_operands.pop_back();
+    return value;
 }
 
-void Interpreter::run_expression_stmt(const Expression &expression) {
+LoxElement Interpreter::evaluate_iteratively(const Expr &root) {
+    if (root.ty == ExprTy::LITERAL) {
+        return evaluate_literal_expr(root.lit);
+    }
+    if (root.ty == ExprTy::VAR_EXPR) {
+        return evaluate_variable_expr(root.var_expr).copy();
+    }
+    // Calls re-enter here (through the callee's statements) and stack their
+    // frames on top of ours. If a runtime error is raised, everything above
+    // where we started is dropped
+    struct Unwind {
+        Interpreter *interp;
+        size_t frames;
+        size_t operands;
+        ~Unwind() {
+            auto &ops = this->interp->eval_operands;
+            this->interp->eval_frames.resize(this->frames);
+            ops.erase(ops.begin() + this->operands, ops.end());
+        }
+    } unwind{this, this->eval_frames.size(), this->eval_operands.size()};
+
+    push_eval_frame(root);
+    while (this->eval_frames.size() > unwind.frames && !failed()) {
+        // "frame" is only valid until the next push
+        EvalFrame &frame = this->eval_frames.back();
+        const Expr &expr = *frame.expr;
+        switch (expr.ty) {
+            case ExprTy::GROUPING:
+                if (frame.state++ == 0) {
+                    push_eval_frame(*expr.group.expression);
+                } else {
+                    this->eval_frames.pop_back();
+                }
+                break;
+            case ExprTy::UNARY:
+                if (frame.state++ == 0) {
+                    push_eval_frame(*expr.unary.right);
+                } else {
+                    this->eval_frames.pop_back();
+                    this->eval_operands.push_back(apply_unary(expr.unary, pop_operand()));
+                }
+                break;
+            case ExprTy::BINARY:
+                if (frame.state == 0) {
+                    frame.state++;
+                    push_eval_frame(*expr.bin.left);
+                } else if (frame.state == 1) {
+                    frame.state++;
+                    push_eval_frame(*expr.bin.right);
+                } else {
+                    this->eval_frames.pop_back();
+                    auto &ops = this->eval_operands;
+                    auto result = apply_binary(expr.bin, ops[ops.size() - 2], ops.back());
+                    ops.pop_back();
+                    ops.pop_back();
+                    ops.push_back(std::move(result));
+                }
+                break;
+            case ExprTy::LOGICAL_EXPR:
+                if (frame.state == 0) {
+                    frame.state++;
+                    push_eval_frame(*expr.logical.left);
+                } else if (frame.state == 1) {
+                    // The left operand is the result if it short-circuits
+                    bool truthy = this->eval_operands.back().is_truthy();
+                    if (truthy == (expr.logical.op.type == TokenType::OR)) {
+                        this->eval_frames.pop_back();
+                    } else {
+                        frame.state++;
+                        this->eval_operands.pop_back();
+                        push_eval_frame(*expr.logical.right);
+                    }
+                } else {
+                    this->eval_frames.pop_back();
+                }
+                break;
+            case ExprTy::ASSIGN_EXPR:
+                if (frame.state++ == 0) {
+                    push_eval_frame(*expr.ass_expr.value);
+                } else {
+                    this->eval_frames.pop_back();
+                    this->eval_operands.push_back(assign_value(expr.ass_expr, pop_operand()));
+                }
+                break;
+            case ExprTy::CALL_EXPR: {
+                // State 0 evaluates the callee, state i the i-th argument
+                auto &call = expr.call;
+                int state = frame.state++;
+                if (state == 0) {
+                    push_eval_frame(*call.callee);
+                } else if (state <= (int) call.args.size()) {
+                    push_eval_frame(call.args[state - 1]);
+                } else {
+                    this->eval_frames.pop_back();
+                    size_t first_arg = this->locals.size();
+                    auto first = this->eval_operands.end() - call.args.size();
+                    for (auto it = first; it != this->eval_operands.end(); it++) {
+                        push_arg(call.paren, std::move(*it));
+                    }
+                    this->eval_operands.erase(first, this->eval_operands.end());
+                    auto callee = pop_operand();
+                    this->eval_operands.push_back(call_value(call.paren, callee, first_arg));
+                }
+                break;
+            }
+            default:
+                throw std::runtime_error(
+                        "Unknown expression type when interpreting. This should never happen");
+        }
+    }
+    if (failed()) {
+        return LoxElement::nil();
+    }
+    return pop_operand();
+}
+
+
+Completion Interpreter::run_print_stmt(const Print &print) {
+    LoxElement value = evaluate(print.expr);
+    if (failed()) {
+        return Completion::ERROR;
+    }
+    this->print(value);
+    return Completion::NORMAL;
+}
+
+void Interpreter::print(const LoxElement &value) {
+    // Strings are written straight from the shared characters
+    if (value.ty() == LoxTy::LOX_STRING) {
+        std::cout << value.lox_str() << std::endl;
+        return;
+    }
+    if (value.is_number()) {
+        char buf[LoxElement::NUMBER_CHARS];
+        std::cout.write(buf, LoxElement::format_number(value.lox_number(), buf)) << std::endl;
+        return;
+    }
+    std::cout << value.stringify() << std::endl;
+}
+
+Completion Interpreter::run_expression_stmt(const Expression &expression) {
     evaluate(expression.expr);
+    return status();
 }
 
-void Interpreter::execute(const Stmt &stmt) {
+Completion Interpreter::execute(const Stmt &stmt) {
     switch (stmt.ty) {
         case StmtTy::STMT_EXPR:
-            run_expression_stmt(stmt.expression);
-            break;
+            return run_expression_stmt(stmt.expression);
         case StmtTy::STMT_PRINT:
-            run_print_stmt(stmt.print);
-            break;
+            return run_print_stmt(stmt.print);
         case StmtTy::STMT_VAR:
-            run_var_stmt(stmt.var);
-            break;
+            return run_var_stmt(stmt.var);
         case StmtTy::STMT_BLOCK:
-            run_block_stmt(stmt.block);
-            break;
+            return run_block_stmt(stmt.block);
         case StmtTy::STMT_WHILE:
-            run_while_stmt(stmt.while_stmt);
-            break;
+            return run_while_stmt(stmt.while_stmt);
         case StmtTy::STMT_IF:
-            run_if_stmt(stmt.if_stmt);
-            break;
+            return run_if_stmt(stmt.if_stmt);
         case StmtTy::STMT_FUNC:
-            run_func_stmt(stmt.func_stmt);
-            break;
+            return run_func_stmt(stmt.func_stmt);
         case StmtTy::STMT_RETURN:
-            run_return_stmt(stmt.return_stmt);
-            break;
+            return run_return_stmt(stmt.return_stmt);
         default:
             throw std::runtime_error("Unknown Statement type when executing. This should never happen");
     }
 }
 
-void Interpreter::run_var_stmt(const Var &var) {
+Completion Interpreter::run_var_stmt(const Var &var) {
     if (!var.initializer.is_nil()) {
-        auto val = evaluate(var.initializer);
-        this->env.define(var.name.lexeme, std::move(val));
+        define_local(var.name, evaluate(var.initializer));
     } else {
-        this->env.define(var.name.lexeme, LoxElement::nil());
+        define_local(var.name, LoxElement::nil());
     }
+    return status();
 }
 
-void Interpreter::execute_block(const std::vector <Stmt> &statements, Env env) {
-    // TODO: refactor duplicated code
+Completion Interpreter::execute_statements(const std::vector <Stmt> &statements) {
+    for (auto &st : statements) {
+        Completion completion = execute(st);
+        if (completion != Completion::NORMAL) {
+            return completion;
+        }
+    }
+    return Completion::NORMAL;
+}
 
-    // We know we are in a block, so the enclosing of "env" is the scope above,
-    // so we save it here so that we can restore the state later
-    Env *before = env.enclosing;
-    try {
-        // Execute statements under with the new environment
-        this->env = std::move(env);
-        for (auto &st : statements) {
-            execute(st);
+Completion Interpreter::execute_statements(const CompiledBlock &block) {
+    for (auto &st : block.statements) {
+        Completion completion = st(this);
+        if (completion != Completion::NORMAL) {
+            return completion;
         }
     }
-        // Totally ugly way of making sure the environment is re-established regardless if a runtime error occurred or not
-    catch (LoxRuntimeErr &ler) {
-        // Make sure we don't double free on the move assignment below, because "before" is this->env.enclosing
-        this->env.enclosing = nullptr;
-        // Re-establish state
-        if (before != nullptr) {
-            this->env = std::move(*before);
-            // Free the temporary pointer we allocated after we move out of it
-            delete before;
-        } else {
-            this->env = Env{};
+    return Completion::NORMAL;
+}
+
+Completion Interpreter::run_block_stmt(const Block &block) {
+    // The scope is left however the block is, returns and errors included
+    ValueStack::Scope scope{this->locals};
+    return execute_statements(block.statements);
+}
+
+Completion Interpreter::run_if_stmt(const IfStmt &if_stmt) {
+    bool taken = evaluate(if_stmt.condition).is_truthy();
+    if (failed()) {
+        return Completion::ERROR;
+    }
+    if (this->tracer != nullptr && this->tracer->recording()) {
+        this->tracer->record_branch(&if_stmt, taken);
+    }
+    if (taken) {
+        return execute(*if_stmt.then_branch);
+    } else if (if_stmt.else_branch != nullptr) {
+        return execute(*if_stmt.else_branch);
+    }
+    return Completion::NORMAL;
+}
+
+Completion Interpreter::run_while_stmt(const WhileStmt &while_stmt) {
+    if (this->tracer == nullptr) {
+        while (evaluate(while_stmt.cond).is_truthy() && !failed()) {
+            Completion completion = execute(*while_stmt.body);
+            if (completion != Completion::NORMAL) {
+                return completion;
+            }
+        }
+        return status();
+    }
+    // Count back-edges for the tracing JIT, and let it take over the loop
+    // once it has a trace for it
+    TraceLoop &loop = this->tracer->loop_for(&while_stmt);
+    struct LoopExit {
+        TraceJit *tracer;
+        TraceLoop &loop;
+        ~LoopExit() { this->tracer->loop_exited(this->loop); }
+    } loop_exit{this->tracer.get(), loop};
+    while (evaluate(while_stmt.cond).is_truthy() && !failed()) {
+        Completion completion = execute(*while_stmt.body);
+        if (completion != Completion::NORMAL) {
+            return completion;
+        }
+        if (this->tracer->back_edge(this, loop, &while_stmt)) {
+            break;
         }
-        throw;
     }
+    return status();
+}
 
-    // Do the cleanup, in case no exception was thrown. Explanation is in the catch clause
-    this->env.enclosing = nullptr;
-    if (before != nullptr) {
-        this->env = std::move(*before);
-        delete before;
+Completion Interpreter::run_func_stmt(const FuncStmt *func_stmt) {
+    auto *lox_fun = new LoxFunction(func_stmt, nullptr, jit_function_for(func_stmt));
+    define_local(func_stmt->name, LoxElement(lox_fun));
+    return status();
+}
+
+Completion Interpreter::run_return_stmt(const ReturnStmt &return_stmt) {
+    if (!return_stmt.value.is_nil()) {
+        this->return_value = evaluate(return_stmt.value);
     } else {
-        this->env = Env{};
+        this->return_value = LoxElement::nil();
     }
+    // After the value, whose calls complete returns of their own
+    this->return_keyword = &return_stmt.keyword;
+    return failed() ? Completion::ERROR : Completion::RETURN;
 }
 
-void Interpreter::run_block_stmt(const Block &block) {
-    // We need to be careful here to create a new Env with the current enclosing scope then
-    // reset after we finish executing the block.
-    Env *current_enclosing = new Env(std::move(this->env));
-    Env new_env = Env(current_enclosing);
-    execute_block(block.statements, std::move(new_env));
+bool Interpreter::interpret(const std::vector <Stmt> &statements) {
+    resolve_literals(statements);
+    Completion completion;
+    if (this->engine == Engine::ENGINE_CLOSURE) {
+        auto program = this->compiler->compile(statements);
+        completion = execute_statements(program);
+    } else {
+        completion = execute_statements(statements);
+    }
+    if (completion == Completion::RETURN) {
+        // A return inside a function completes at its call, this one is
+        // outside of any
+        this->return_value = LoxElement::nil();
+        raise(*this->return_keyword, "Can't return from top-level code.");
+        completion = Completion::ERROR;
+    }
+    if (completion == Completion::ERROR) {
+        std::cout << take_error().diagnostic() << std::endl;
+        return false;
+    }
+    return true;
 }
 
-void Interpreter::run_if_stmt(const IfStmt &if_stmt) {
-    if (evaluate(if_stmt.condition).is_truthy()) {
-        execute(*if_stmt.then_branch);
-    } else if (if_stmt.else_branch != nullptr) {
-        execute(*if_stmt.else_branch);
+void Interpreter::prepare(const std::vector<Stmt> &statements) {
+    resolve_literals(statements);
+    if (this->engine == Engine::ENGINE_CLOSURE) {
+        // Only the function bodies are kept, see ClosureCompiler::bodies
+        this->compiler->compile(statements);
     }
 }
 
-void Interpreter::run_while_stmt(const WhileStmt &while_stmt) {
-    while (evaluate(while_stmt.cond).is_truthy()) {
-        execute(*while_stmt.body);
+LoxFunction *Interpreter::make_function(const FuncStmt *decl) {
+    const CompiledBlock *body = nullptr;
+    if (this->engine == Engine::ENGINE_CLOSURE) {
+        body = this->compiler->body_of(decl);
+        ASSERT_COND(body != nullptr, "Function of a program that wasn't prepared");
     }
+    return new LoxFunction(decl, body, jit_function_for(decl));
 }
 
-void Interpreter::run_func_stmt(const FuncStmt *func_stmt) {
-    auto *lox_fun = new LoxFunction(func_stmt);
-    this->env.define(func_stmt->name.lexeme, LoxElement(lox_fun));
+void Interpreter::raise(const Token &where, std::string why) {
+    if (!failed()) {
+        this->error.emplace(where.clone(), std::move(why));
+    }
 }
 
-void Interpreter::run_return_stmt(const ReturnStmt &return_stmt) {
-    LoxElement val = LoxElement::nil();
-    if (!return_stmt.value.is_nil()) {
-        val = evaluate(return_stmt.value);
-    }
+void Interpreter::raise(const Token &where, const char *why) {
+    raise(where, std::string{why});
+}
 
-    throw new ReturnException(std::move(val));
+LoxRuntimeErr Interpreter::take_error() {
+    LoxRuntimeErr err = std::move(*this->error);
+    this->error.reset();
+    return err;
 }
 
-void Interpreter::interpret(const std::vector <Stmt> &statements) {
-    try {
-        for (auto &stmt : statements) {
-            execute(stmt);
-        }
-    } catch (LoxRuntimeErr &ler) {
-        std::cout << ler.diagnostic() << std::endl;
+void Interpreter::define_local(const Token &name, LoxElement val) {
+    if (!this->locals.define(name, std::move(val))) {
+        raise(name, "Stack overflow.");
     }
 }
 
@@ -559,109 +1304,266 @@ std::string LoxRuntimeErr::diagnostic() const {
     return res;
 }
 
-Env::Env(Env *enclosing) : enclosing(enclosing) {}
+Env::Env() {}
 
-Env::Env(Env &&to_move) : values(std::move(to_move.values)) {
-    this->enclosing = to_move.enclosing;
-    to_move.enclosing = nullptr;
+static size_t name_hash(std::string_view name) {
+    return std::hash<std::string_view>{}(name);
 }
 
-Env &Env::operator=(Env &&to_move) {
-    this->values = std::move(to_move.values);
-    this->enclosing = to_move.enclosing;
-    to_move.enclosing = nullptr;
-    return *this;
+Env::Entry *Env::lookup(std::string_view name) {
+    if (this->table.empty()) {
+        for (size_t i = 0; i < this->count; i++) {
+            if (this->inline_entries[i].name == name) {
+                return &this->inline_entries[i];
+            }
+        }
+        return nullptr;
+    }
+    size_t hash = name_hash(name);
+    size_t mask = this->table.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        Entry &entry = this->table[i];
+        if (entry.name.empty()) {
+            return nullptr;
+        }
+        if (entry.hash == hash && entry.name == name) {
+            return &entry;
+        }
+    }
 }
 
-Env::~Env() {
-    if (this->enclosing != nullptr) {
-        delete enclosing;
+void Env::insert_into_table(Entry entry) {
+    size_t mask = this->table.size() - 1;
+    size_t i = entry.hash & mask;
+    while (!this->table[i].name.empty()) {
+        i = (i + 1) & mask;
     }
+    this->table[i] = std::move(entry);
 }
 
-Env::Env() {}
+void Env::grow() {
+    size_t new_size = this->table.empty() ? MIN_TABLE_SIZE : this->table.size() * 2;
+    std::vector<Entry> old = std::move(this->table);
+    if (old.empty()) {
+        for (size_t i = 0; i < this->count; i++) {
+            Entry &entry = this->inline_entries[i];
+            entry.hash = name_hash(entry.name);
+            old.push_back(std::move(entry));
+            entry = Entry{};
+        }
+    }
+    this->table = std::vector<Entry>(new_size);
+    for (auto &entry : old) {
+        if (!entry.name.empty()) {
+            insert_into_table(std::move(entry));
+        }
+    }
+}
 
 void Env::define(std::string name, LoxElement val) {
-    auto iter = this->values.find(name);
-    if (iter != this->values.end()) {
-        // We allow redefinitions of variables
-        this->values.erase(iter);
+    // We allow redefinitions of variables
+    Entry *entry = lookup(name);
+    if (entry != nullptr) {
+        entry->value = std::move(val);
+        return;
+    }
+    if (this->table.empty() && this->count < INLINE_ENTRIES) {
+        this->inline_entries[this->count++] = Entry{std::move(name), 0, std::move(val)};
+        return;
+    }
+    if (this->table.empty() || (this->count + 1) * 2 > this->table.size()) {
+        grow();
     }
-    this->values.insert({std::move(name), std::move(val)});
+    size_t hash = name_hash(name);
+    insert_into_table(Entry{std::move(name), hash, std::move(val)});
+    this->count++;
 }
 
 bool Env::erase(const std::string &name) {
-    return this->values.erase(name) != 0;
+    Entry *entry = lookup(name);
+    if (entry == nullptr) {
+        return false;
+    }
+    this->count--;
+    if (this->table.empty()) {
+        // Keep the inline entries packed
+        *entry = std::move(this->inline_entries[this->count]);
+        this->inline_entries[this->count] = Entry{};
+        return true;
+    }
+    // Backward shift deletion: pull later entries of the probe sequence into
+    // the hole, so lookups never stop early at it
+    size_t mask = this->table.size() - 1;
+    size_t hole = entry - this->table.data();
+    *entry = Entry{};
+    for (size_t i = (hole + 1) & mask; !this->table[i].name.empty(); i = (i + 1) & mask) {
+        size_t home = this->table[i].hash & mask;
+        // Can move to the hole unless its home lies in (hole, i]
+        bool stays = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+        if (!stays) {
+            this->table[hole] = std::move(this->table[i]);
+            this->table[i] = Entry{};
+            hole = i;
+        }
+    }
+    return true;
 }
 
 bool Env::contains(const Token &name) {
-    return this->values.find(name.lexeme) != this->values.end();
+    return lookup(name.lexeme) != nullptr;
 }
 
 size_t Env::size() const {
-    return this->values.size();
+    return this->count;
 }
 
-LoxElement::LoxElement(const LoxElement &other) {
-    switch (other.ty) {
-        case LoxTy::LOX_NIL:
-            this->lox_nil = LoxTy::LOX_NIL;
-            break;
-        case LoxTy::LOX_NUMBER:
-            this->lox_number = other.lox_number;
-            break;
-        case LoxTy::LOX_BOOL:
-            this->lox_bool = other.lox_bool;
-            break;
+LoxElement::LoxElement(const LoxElement &other) : bits(other.bits) {
+    if (other.is_obj()) {
+        other.as_obj()->refs++;
+    }
+}
+
+LoxElement LoxElement::copy() const {
+    return LoxElement(*this);
+}
+
+LoxElement LoxElement::escape() const {
+    if (!is_obj()) {
+        return *this;
+    }
+    LoxHeap::Outside outside;
+    switch (ty()) {
         case LoxTy::LOX_STRING:
-            init_union_field(this->lox_str, std::string, other.lox_str);
-            break;
-        case LoxTy::LOX_OBJ:
-            // Probably need a find a way to alias this one. Maybe LoxObj will internally contain shared_ptr so that we avoid
-            // double freeing the object when we hand out a way to copy it?
-            break;
+            // Never interned, the table would hand back the region's string
+            return LoxElement(LoxString::create(lox_str()));
         case LoxTy::LOX_CALLABLE:
-            init_union_field(this->callable, std::shared_ptr < LoxCallable >, other.callable);
-            break;
+            if (callable()->kind == CallableKind::USER_FN) {
+                return LoxElement(new LoxFunction(static_cast<LoxFunction *>(callable())->copy()));
+            } else {
+                auto *native = static_cast<NativeFn *>(callable());
+                return LoxElement(new NativeFn(native->code, native->params));
+            }
         default:
-            std::cerr << "Unknown Lox type when copying" << std::endl;
+            UNREACHABLE();
     }
-    this->ty = other.ty;
 }
 
-LoxElement LoxElement::copy() const {
-    return LoxElement(*this);
+LoxElement *Env::find(std::string_view name) {
+    Entry *entry = lookup(name);
+    return entry == nullptr ? nullptr : &entry->value;
 }
 
-void Env::assign(Token name, LoxElement val) {
-    if (this->values.find(name.lexeme) != this->values.end()) {
-        this->values.erase(name.lexeme);
-        this->values.insert({std::move(name.lexeme), std::move(val)});
-        return;
+const std::string *Env::name_of(const LoxCallable *callable) const {
+    const Entry *entries = this->table.empty() ? this->inline_entries : this->table.data();
+    size_t n = this->table.empty() ? this->count : this->table.size();
+    for (size_t i = 0; i < n; i++) {
+        const LoxElement &value = entries[i].value;
+        if (!entries[i].name.empty() && value.is_callable() && value.callable() == callable) {
+            return &entries[i].name;
+        }
     }
-    if (this->enclosing != nullptr) {
-        this->enclosing->assign(std::move(name), std::move(val));
-        return;
+    return nullptr;
+}
+
+ValueStack::ValueStack()
+    : names(static_cast<std::string_view *>(::operator new(MAX_SLOTS * sizeof(std::string_view)))),
+      values(static_cast<LoxElement *>(::operator new(MAX_SLOTS * sizeof(LoxElement)))) {}
+
+ValueStack::~ValueStack() {
+    leave(Mark{0, 0, 0});
+    ::operator delete(this->names);
+    ::operator delete(this->values);
+}
+
+ValueStack::Scope::Scope(ValueStack &stack, bool new_frame)
+    : stack(stack), mark(new_frame ? stack.enter_frame() : stack.enter_scope()) {}
+
+ValueStack::Scope::Scope(ValueStack &stack, size_t first_arg, const std::vector<Token> &params)
+    : stack(stack), mark(stack.enter_call(first_arg, params)) {}
+
+ValueStack::Mark ValueStack::enter_scope() {
+    Mark mark{this->top, this->scope_base, this->frame_base};
+    this->scope_base = this->top;
+    return mark;
+}
+
+ValueStack::Mark ValueStack::enter_frame() {
+    Mark mark = enter_scope();
+    this->frame_base = this->top;
+    return mark;
+}
+
+ValueStack::Mark ValueStack::enter_call(size_t first_arg, const std::vector<Token> &params) {
+    Mark mark{first_arg, this->scope_base, this->frame_base};
+    this->scope_base = first_arg;
+    this->frame_base = first_arg;
+    for (size_t i = 0; i < params.size(); i++) {
+        this->names[first_arg + i] = params[i].lexeme;
     }
+    return mark;
+}
 
-    std::string err = "Undefined variable '";
-    err += name.lexeme;
-    err += "'.";
-    throw LoxRuntimeErr(std::move(name), std::move(err));
+void ValueStack::leave(const Mark &mark) {
+    truncate(mark.top);
+    this->scope_base = mark.scope_base;
+    this->frame_base = mark.frame_base;
 }
 
-LoxElement &Env::get(const Token &name) {
-    auto iter = this->values.find(name.lexeme);
-    if (iter != this->values.end()) {
-        return iter->second;
+void ValueStack::truncate(size_t slot) {
+    while (this->top > slot) {
+        this->values[--this->top].~LoxElement();
     }
-    if (this->enclosing != nullptr) {
-        return this->enclosing->get(name);
+}
+
+size_t ValueStack::lookup(std::string_view name) {
+    for (size_t i = this->top; i > this->frame_base; i--) {
+        if (this->names[i - 1] == name) {
+            return i - 1;
+        }
     }
-    std::string err = "Undefined variable '";
-    err += name.lexeme;
-    err += "'.";
-    throw LoxRuntimeErr{name.clone(), err};
+    return MAX_SLOTS;
+}
+
+bool ValueStack::define(const Token &name, LoxElement val) {
+    // We allow redefinitions of variables
+    for (size_t i = this->top; i > this->scope_base; i--) {
+        if (this->names[i - 1] == name.lexeme) {
+            this->values[i - 1] = std::move(val);
+            return true;
+        }
+    }
+    if (this->top == MAX_SLOTS) {
+        return false;
+    }
+    this->names[this->top] = name.lexeme;
+    new (&this->values[this->top]) LoxElement(std::move(val));
+    this->top++;
+    return true;
+}
+
+bool ValueStack::push_arg(LoxElement val) {
+    if (this->top == MAX_SLOTS) {
+        return false;
+    }
+    // Empty, so no lookup matches it until enter_call names it
+    this->names[this->top] = std::string_view{};
+    new (&this->values[this->top]) LoxElement(std::move(val));
+    this->top++;
+    return true;
+}
+
+bool ValueStack::assign(const Token &name, LoxElement val) {
+    size_t slot = lookup(name.lexeme);
+    if (slot == MAX_SLOTS) {
+        return false;
+    }
+    this->values[slot] = std::move(val);
+    return true;
+}
+
+LoxElement *ValueStack::find(std::string_view name) {
+    size_t slot = lookup(name);
+    return slot == MAX_SLOTS ? nullptr : &this->values[slot];
 }
 
 static long long get_system_time() {
@@ -673,21 +1575,42 @@ static long long get_system_time() {
     return t;
 }
 
-LoxCallable::~LoxCallable() {}
-
-int NativeClockFn::arity() {
-    return 0;
+int LoxCallable::arity() const {
+    switch (this->kind) {
+        case CallableKind::USER_FN:
+            return static_cast<const LoxFunction *>(this)->arity();
+        case CallableKind::NATIVE_FN:
+            return static_cast<const NativeFn *>(this)->params;
+    }
+    UNREACHABLE();
 }
 
-NativeClockFn::~NativeClockFn() {}
+std::string LoxCallable::to_string() const {
+    switch (this->kind) {
+        case CallableKind::USER_FN:
+            return static_cast<const LoxFunction *>(this)->to_string();
+        case CallableKind::NATIVE_FN:
+            return "<native fn>";
+    }
+    UNREACHABLE();
+}
 
+void LoxCallable::destroy(LoxCallable *callable) {
+    switch (callable->kind) {
+        case CallableKind::USER_FN:
+            delete static_cast<LoxFunction *>(callable);
+            break;
+        case CallableKind::NATIVE_FN:
+            delete static_cast<NativeFn *>(callable);
+            break;
+    }
+}
 
-LoxElement NativeClockFn::call(Interpreter *interp, std::vector <LoxElement> args) {
+static LoxElement native_clock(Interpreter *, std::span<LoxElement>) {
     return LoxElement(static_cast<double>(get_system_time()));
 }
 
-std::string NativeClockFn::to_string() const {
-    return "<native fn>";
+static LoxElement native_allocations(Interpreter *, std::span<LoxElement>) {
+    return LoxElement(static_cast<double>(AllocCounter::allocations()));
 }
 
-ReturnException::ReturnException(LoxElement value): value(std::move(value)) {}
@@ -1,73 +1,231 @@
 #ifndef INTERPRETER_H_
 #define INTERPRETER_H_
 
+#include <bit>
+#include <cstdint>
 #include <memory>
+#include <optional>
+#include <ostream>
+#include <span>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
+#include "heap.hpp"
 #include "../LexParse/expr.hpp"
 #include "../LexParse/stmt.hpp"
 #include "../LexParse/tokens.hpp"
 
 class Interpreter;
 class LoxElement;
+class ClosureCompiler;
+class CompiledBlock;
+class Jit;
+class JitFunction;
+class LoxFunction;
+class TraceJit;
 
-// NOTE: This should really be an interface but it's a bit awkward
-// because then our LoxElement would need to be generic over some T which
-// implements LoxCallable which makes it awkward, so we leave it as an abstract
-// class for simplicity. (Right now the overhead of dynamic dispatch isn't
-// terribly important)
-class LoxCallable {
+enum LoxTy { LOX_NUMBER, LOX_STRING, LOX_NIL, LOX_OBJ, LOX_BOOL, LOX_CALLABLE };
+
+// Header of everything a LoxElement can point to, saying what it is. Every
+// LoxElement pointing to an object owns a reference to it. The count isn't
+// atomic, the interpreter is single threaded
+class LoxHeapObj {
 public:
-  virtual int arity() = 0;
-  virtual LoxElement call(Interpreter *interp,
-                          std::vector<LoxElement> args) = 0;
-  virtual std::string to_string() const = 0;
-  // Moves out of this object, heap-allocating it so it can be used by
-  // shared_ptr's constructor
-  virtual ~LoxCallable() = 0;
+  LoxTy ty;
+  long refs = 1;
+  LoxHeapObj(LoxTy ty) : ty(ty) {}
+  // Objects live in the LoxHeap. They are always deleted as their exact
+  // class, so "size" is what they were allocated with
+  static void *operator new(size_t size) { return LoxHeap::allocate(size); }
+  static void operator delete(void *mem, size_t size) { LoxHeap::release(mem, size); }
 };
 
-static long long get_system_time();
+enum class CallableKind {
+  USER_FN,   // a LoxFunction
+  NATIVE_FN, // a NativeFn
+};
 
-class NativeClockFn : public LoxCallable {
-  int arity();
-  LoxElement call(Interpreter *interp, std::vector<LoxElement> args);
+// Callables are tagged rather than virtual: Interpreter::call_value switches
+// on "kind" and calls the LoxFunction or the native code directly, and
+// LoxElement::release deletes the right class
+class LoxCallable : public LoxHeapObj {
+public:
+  const CallableKind kind;
+  int arity() const;
   std::string to_string() const;
-  ~NativeClockFn();
+  // Deletes the LoxFunction or NativeFn "callable" is
+  static void destroy(LoxCallable *callable);
+protected:
+  LoxCallable(CallableKind kind) : LoxHeapObj(LoxTy::LOX_CALLABLE), kind(kind) {}
 };
 
-enum LoxTy { LOX_NUMBER, LOX_STRING, LOX_NIL, LOX_OBJ, LOX_BOOL, LOX_CALLABLE };
+// Arguments have been checked against the arity already
+using NativeCode = LoxElement (*)(Interpreter *interp, std::span<LoxElement> args);
+
+// A function implemented in C++, like "clock"
+class NativeFn : public LoxCallable {
+public:
+  const NativeCode code;
+  const int params;
+  NativeFn(NativeCode code, int params)
+      : LoxCallable(CallableKind::NATIVE_FN), code(code), params(params) {}
+};
+
+static long long get_system_time();
+
+/* An immutable Lox string, shared by every LoxElement holding it, so copying
+ * an element never copies characters. The hash is computed once, the first
+ * time it's needed.
+ *
+ * A string is either flat, its characters following the header in the same
+ * allocation, or a rope: the concatenation of two other strings, which long
+ * concatenations make instead of copying (so "s = s + piece" in a loop is
+ * linear, not quadratic). A rope is flattened into one buffer the first time
+ * its characters are needed (printing, comparing, hashing), and lets go of
+ * its halves then. Appending a short piece to a rope copies only the last
+ * leaf, and a rope that got deeper than MAX_ROPE_DEPTH is rebuilt balanced */
+class LoxString : public LoxHeapObj {
+private:
+  friend class StringTable;
+  mutable size_t cached_hash = 0;
+  // In the StringTable, so equal to another interned string only if it's us
+  bool interned = false;
+  // The characters, nullptr until a rope is flattened
+  mutable const char *data;
+  // The two halves of a rope (we own a reference to each), nullptr when flat
+  mutable LoxString *left = nullptr;
+  mutable LoxString *right = nullptr;
+  mutable int depth = 0;
+
+  LoxString(size_t len) : LoxHeapObj(LoxTy::LOX_STRING), data(inline_chars()), len(len) {}
+  static LoxString *alloc(size_t len);
+  // The ropes below take over the references to "left" and "right"
+  static LoxString *join(LoxString *left, LoxString *right);
+  static LoxString *rope(LoxString *left, LoxString *right);
+  static LoxString *flat_concat(const LoxString &left, const LoxString &right);
+  static void collect_leaves(LoxString *str, std::vector<LoxString *> &leaves);
+  static LoxString *balanced(const std::vector<LoxString *> &leaves, size_t from, size_t to);
+  static LoxString *rebalance(LoxString *rope);
+  char *inline_chars() { return reinterpret_cast<char *>(this + 1); }
+  // What "alloc" or "join" took from the LoxHeap for us
+  size_t allocated_size() { return this->data == inline_chars() ? sizeof(LoxString) + this->len + 1 : sizeof(LoxString); }
+  void flatten() const;
 
-/* An actual element (loosely, object) from Lox. It can either be
- * a string, a number, or an object (thinking in terms of Lox)
+public:
+  static constexpr size_t ROPE_LEAF_MAX = 4096;
+  static constexpr int MAX_ROPE_DEPTH = 48;
+
+  const size_t len;
+  static LoxString *create(std::string_view chars);
+  // Interned if the result is short enough for the StringTable's policy
+  static LoxString *concat(LoxString &left, LoxString &right);
+  static void destroy(LoxString *str);
+  static void release(LoxString *str) {
+    if (--str->refs == 0) {
+      destroy(str);
+    }
+  }
+  LoxString *retain() {
+    this->refs++;
+    return this;
+  }
+  bool is_rope() const { return this->left != nullptr; }
+  const char *chars() const {
+    if (this->data == nullptr) {
+      flatten();
+    }
+    return this->data;
+  }
+  std::string_view view() const { return {chars(), this->len}; }
+  size_t hash() const;
+  bool equals(const LoxString &other) const;
+};
+
+/* Interned strings: at most one LoxString for each content, so comparing two
+ * interned strings is comparing pointers, and their hash is computed once when
+ * they're interned. The table is weak, it doesn't keep its strings alive: a
+ * string leaves it when its last reference goes away.
+ * String literals are always interned, strings made at runtime only if they
+ * are at most max_runtime_len bytes long (--intern-max=N). Short strings are
+ * the ones that get compared over and over (status codes, keys), long ones
+ * would only cost a lookup */
+class StringTable {
+public:
+  static constexpr long DEFAULT_MAX_RUNTIME_LEN = 16;
+  // -1 interns every runtime string, 0 none
+  static long max_runtime_len;
+  // Returns a new reference to the interned string with these characters
+  static LoxString *intern(std::string_view chars);
+  // Same, for a string nobody else has seen yet, which it takes over
+  static LoxString *intern(LoxString *fresh);
+  static bool should_intern(size_t len) {
+    return max_runtime_len < 0 || (long) len <= max_runtime_len;
+  }
+  static void remove(LoxString *str);
+  static size_t size();
+};
+
+/* An actual element (loosely, object) from Lox, NaN-boxed into 8 bytes.
+ *
+ * A number is stored as its own bits. Everything else hides in the quiet NaNs
+ * with both of the top two mantissa bits set, which no arithmetic produces
+ * (and which the number constructor folds into the canonical NaN): nil, false
+ * and true are fixed patterns, and strings and callables are the 48-bit
+ * address of a LoxHeapObj with the sign bit set on top.
+ * So moving an element is copying 8 bytes, and only elements pointing to the
+ * heap have anything to do when destroyed.
  * */
 class LoxElement {
 private:
+  static constexpr uint64_t SIGN_BIT = 0x8000000000000000;
+  static constexpr uint64_t QNAN = 0x7ffc000000000000;
+  static constexpr uint64_t CANONICAL_NAN = 0x7ff8000000000000;
+  static constexpr uint64_t NIL_BITS = QNAN | 1;
+  static constexpr uint64_t FALSE_BITS = QNAN | 2;
+  static constexpr uint64_t TRUE_BITS = QNAN | 3;
+  static constexpr uint64_t OBJ_BITS = SIGN_BIT | QNAN;
+
+  uint64_t bits;
+
   LoxElement(LoxTy _nil);
   LoxElement(const LoxElement &other);
+  LoxElement(LoxHeapObj *obj) : bits(OBJ_BITS | (uint64_t) (uintptr_t) obj) {}
+  bool is_obj() const { return (this->bits & OBJ_BITS) == OBJ_BITS; }
+  LoxHeapObj *as_obj() const { return (LoxHeapObj *) (uintptr_t) (this->bits & ~OBJ_BITS); }
+  // Drops what we point to
+  void release();
 
 public:
-  LoxTy ty;
-  union {
-    double lox_number;
-    std::string lox_str;
-    bool lox_bool;
-    /* LoxObject obj; */
-    LoxTy lox_nil; // should only ever be LOX_NIL, it's a placeholder
-    std::shared_ptr<LoxCallable> callable;
-  };
-
   static LoxElement nil();
+  LoxTy ty() const {
+    if (is_number()) {
+      return LoxTy::LOX_NUMBER;
+    }
+    if (is_obj()) {
+      return as_obj()->ty;
+    }
+    return this->bits == NIL_BITS ? LoxTy::LOX_NIL : LoxTy::LOX_BOOL;
+  }
   bool is_instance_of(LoxTy ty) const;
-  bool is_number() const;
+  bool is_number() const { return (this->bits & QNAN) != QNAN; }
   double as_number() const;
-  bool is_nil() const;
+  bool is_nil() const { return this->bits == NIL_BITS; }
 
-  bool equals(const LoxElement &other);
+  // Unchecked accessors, the element has to be of the right type
+  double lox_number() const { return std::bit_cast<double>(this->bits); }
+  bool lox_bool() const { return this->bits == TRUE_BITS; }
+  LoxString *as_string() const { return static_cast<LoxString *>(as_obj()); }
+  std::string_view lox_str() const { return as_string()->view(); }
+  LoxCallable *callable() const { return static_cast<LoxCallable *>(as_obj()); }
+
+  bool equals(const LoxElement &other) const;
 
   LoxElement copy() const;
+  // A copy allocated from the normal heap, that outlives the LoxHeap::Region
+  // we may be in. Strings and callables are copied, not shared
+  LoxElement escape() const;
 
   bool is_truthy() const;
 
@@ -75,24 +233,50 @@ public:
 
   std::string stringify() const;
 
-  LoxElement(double num);
-  LoxElement(std::string str);
-  LoxElement(bool b);
+  // Enough room for any number written by format_number
+  static constexpr size_t NUMBER_CHARS = 32;
+  // Writes the shortest text that reads back as "num" to "out" (at least
+  // NUMBER_CHARS long, not terminated) and returns its length. Whole numbers
+  // below 1e15 are written without a fraction or exponent, everything else
+  // like printf's %g with just enough digits to round-trip
+  static size_t format_number(double num, char *out);
+
+  LoxElement(double num) : bits(std::bit_cast<uint64_t>(num)) {
+    if ((this->bits & QNAN) == QNAN) {
+      this->bits = CANONICAL_NAN;
+    }
+  }
+  LoxElement(std::string_view str);
+  LoxElement(const std::string &str) : LoxElement(std::string_view(str)) {}
+  // Takes over the reference "str" was created with
+  LoxElement(LoxString *str) : LoxElement(static_cast<LoxHeapObj *>(str)) {}
+  LoxElement(bool b) : bits(b ? TRUE_BITS : FALSE_BITS) {}
+  // Takes over the reference "callable" was created with
   LoxElement(LoxCallable *callable);
-  LoxElement(LoxElement &&to_move);
+  LoxElement(LoxElement &&to_move) : bits(to_move.bits) { to_move.bits = NIL_BITS; }
 
-  LoxElement &operator=(LoxElement &&to_move);
+  LoxElement &operator=(LoxElement &&to_move) {
+    if (this != &to_move) {
+      if (is_obj()) {
+        release();
+      }
+      this->bits = to_move.bits;
+      to_move.bits = NIL_BITS;
+    }
+    return *this;
+  }
 
-  ~LoxElement();
+  ~LoxElement() {
+    if (is_obj()) {
+      release();
+    }
+  }
 };
 
-/* Yes, dynamic exceptions are bad, but for this specific case it makes sense to
- * use one. In an actual real interpreter it's better to use a variant type for
- * error handling. However, in our case, a runtime error occurring is a fine
- * case for throwing an exception, there is no way of recovering from such an
- * error, so we just halt. I.e the performance sacrifice of an exception
- * is not a problem, since it is non-recoverable as far as the user is
- * concerned. */
+/* A runtime error, which halts the program. It isn't thrown while running:
+ * Interpreter::raise records it and the evaluation unwinds by returning (see
+ * Completion::ERROR), so the hot paths only ever test a flag. It's only
+ * thrown to embedders, see BatchExecutor::run */
 class LoxRuntimeErr : std::exception {
 private:
   Token where;
@@ -104,83 +288,287 @@ public:
   LoxRuntimeErr(Token where, const char *why);
 };
 
-class DivisionByZeroErr : public LoxRuntimeErr {
-public:
-  DivisionByZeroErr(Token where, std::string why)
-      : LoxRuntimeErr(std::move(where), std::move(why)) {}
-};
-
+/* The globals (natives like "clock"), looked up before the locals on every
+ * variable access. A flat map for the handful of names it holds: the first
+ * INLINE_ENTRIES live inside the Env and are found by a linear scan. Past
+ * that, entries move to an open-addressing table with linear probing, each
+ * keeping its key's hash. Redefining a name overwrites its value in place */
 class Env {
 private:
-  std::unordered_map<std::string, LoxElement> values;
+  struct Entry {
+    // Empty for a free table slot, no identifier is
+    std::string name;
+    size_t hash = 0;
+    LoxElement value = LoxElement::nil();
+  };
+  static constexpr size_t INLINE_ENTRIES = 4;
+  static constexpr size_t MIN_TABLE_SIZE = 16;
+  Entry inline_entries[INLINE_ENTRIES];
+  size_t count = 0;
+  // Empty while the inline entries suffice, then a power of two at most
+  // half full
+  std::vector<Entry> table;
+
+  Entry *lookup(std::string_view name);
+  void insert_into_table(Entry entry);
+  void grow();
 
 public:
-  Env *enclosing = nullptr;
   Env();
-  Env(Env *enclosing);
   size_t size() const;
   void define(std::string name, LoxElement val);
   bool erase(const std::string &name);
-  void assign(Token name, LoxElement val);
   bool contains(const Token &name);
-  LoxElement &get(const Token &name);
-  Env(Env &&to_move);
-  Env &operator=(Env &&to_move);
+  // nullptr if "name" isn't defined
+  LoxElement *find(std::string_view name);
+  // The name of a global holding "callable", nullptr if none does
+  const std::string *name_of(const LoxCallable *callable) const;
+};
+
+/* The local variables of the running code, all on one contiguous stack of
+ * (name, value) slots. A block's scope is the slots pushed since it was
+ * entered, so entering and leaving one only moves the stack pointer (and
+ * releases the values leaving it). A function call starts a frame: lookups
+ * don't go below its first slot, a function sees its parameters, itself and
+ * its own locals, but not its caller's.
+ *
+ * Names are looked up by scanning down from the top, which beats hashing for
+ * the handful of variables a scope has. They point into the AST, so they
+ * outlive the slots. The stack is reserved once and never moves, so pointers
+ * to values stay valid until their slot is popped.
+ *
+ * Call arguments are evaluated straight onto the stack, as nameless slots
+ * the caller's lookups can't see. The call's frame then starts at the first
+ * of them and names them after the parameters, so passing arguments copies
+ * nothing. Names and values are kept in two arrays, so a call's arguments
+ * are one contiguous run of LoxElements (see args) */
+class ValueStack {
+public:
+  static constexpr size_t MAX_SLOTS = 1 << 20;
+
+  // Where a scope or frame was entered, to go back to on leaving it
+  struct Mark {
+    size_t top;
+    size_t scope_base;
+    size_t frame_base;
+  };
+
+  // Leaves the scope (or frame) it entered when destroyed, however that is
+  class Scope {
+  private:
+    ValueStack &stack;
+    Mark mark;
+  public:
+    Scope(ValueStack &stack, bool new_frame = false);
+    // The frame of a call, whose arguments were pushed from "first_arg" on
+    Scope(ValueStack &stack, size_t first_arg, const std::vector<Token> &params);
+    ~Scope() { this->stack.leave(this->mark); }
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+  };
+
+private:
+  std::string_view *names;
+  LoxElement *values;
+  size_t top = 0;
+  size_t scope_base = 0;
+  size_t frame_base = 0;
+
+  // The slot of "name", MAX_SLOTS if it isn't defined
+  size_t lookup(std::string_view name);
+
+public:
+  ValueStack();
+  ~ValueStack();
+  ValueStack(const ValueStack &) = delete;
+  ValueStack &operator=(const ValueStack &) = delete;
+
+  Mark enter_scope();
+  Mark enter_frame();
+  // Starts a frame at "first_arg", naming the arguments after "params"
+  Mark enter_call(size_t first_arg, const std::vector<Token> &params);
+  void leave(const Mark &mark);
+  // Pops everything from "slot" on
+  void truncate(size_t slot);
+  size_t size() const { return this->top; }
+  std::string_view name_at(size_t slot) const { return this->names[slot]; }
+  const LoxElement &value_at(size_t slot) const { return this->values[slot]; }
+  // Defines (or redefines) "name" in the innermost scope. Its lexeme has to
+  // outlive the slot. Returns false if the stack is full
+  bool define(const Token &name, LoxElement val);
+  // Pushes a call argument, returning false if the stack is full
+  bool push_arg(LoxElement val);
+  // The arguments pushed from "first_arg" on
+  std::span<LoxElement> args(size_t first_arg) {
+    return std::span<LoxElement>(this->values + first_arg, this->top - first_arg);
+  }
+  // Returns false if "name" isn't defined
+  bool assign(const Token &name, LoxElement val);
+  // nullptr if "name" isn't defined
+  LoxElement *find(std::string_view name);
+};
 
-  ~Env();
+// How many binary nodes of each kind (BinarySpec) specialized themselves, and
+// how many of those had to go back to the generic node (--spec-stats)
+class SpecStats {
+public:
+  long specializations[BinarySpec::SPEC_COUNT] = {};
+  long despecializations[BinarySpec::SPEC_COUNT] = {};
+  void report(std::ostream &out) const;
 };
 
+// How a statement finished. A return statement stores its value in
+// Interpreter::return_value and reports RETURN, which every enclosing
+// statement passes on as is, up to the LoxFunction::call it returns from.
+// ERROR goes all the way up, a runtime error was raised
+enum class Completion { NORMAL, RETURN, ERROR };
+
+// Which execution engine runs the program. ENGINE_TREE walks the AST
+// directly, ENGINE_CLOSURE first compiles it into closures (see
+// closure_compiler.hpp)
+enum Engine { ENGINE_TREE, ENGINE_CLOSURE };
+
 class Interpreter {
 private:
+  friend class ClosureCompiler;
+
+  Engine engine;
+  std::unique_ptr<ClosureCompiler> compiler;
+
+  // An expression waiting on its operands: "state" counts the operands
+  // evaluated so far
+  struct EvalFrame {
+    const Expr *expr;
+    int state;
+  };
+  // The runtime error being propagated, see raise
+  std::optional<LoxRuntimeErr> error;
+  // The string literals whose interned string we hold a reference to
+  std::vector<const LiteralExpr *> interned_literals;
+
+  bool stack_eval = false;
+  size_t max_eval_depth = 0;
+  std::vector<EvalFrame> eval_frames;
+  std::vector<LoxElement> eval_operands;
+
   // HACK. Do we just return pointers (or shared_ptrs) to LoxElements? variable
   // exprs have return type references to LoxElements which are valid as long as
   // they are in the map (AND are not variables which have been redefined since
   // the reference was given out)
   LoxElement evaluate_literal(const Literal &literal);
+  LoxElement evaluate_literal_expr(const LiteralExpr &lit);
+  void intern_literal(const LiteralExpr &lit);
+  // Turns every string literal of "statements" into its runtime constant
+  // up front, so evaluating one never allocates, even the first time
+  void resolve_literals(const std::vector<Stmt> &statements);
   LoxElement evaluate_binary_expr(const BinaryExpr &binary);
+  // The generic binary node, on already evaluated operands
+  LoxElement evaluate_binary_op(const BinaryExpr &binary, const LoxElement &left,
+                                const LoxElement &right);
+  void specialize(const BinaryExpr &binary, const LoxElement &left,
+                  const LoxElement &right);
+  void despecialize(const BinaryExpr &binary);
+  // The specialized (or generic) binary node, on already evaluated operands
+  LoxElement apply_binary(const BinaryExpr &binary, const LoxElement &left,
+                          const LoxElement &right);
+  LoxElement apply_unary(const UnaryExpr &unary, LoxElement right);
+  LoxElement assign_value(const AssignExpr &assign, LoxElement value);
   LoxElement evaluate_grouping_expr(const GroupingExpr &group);
   LoxElement evaluate_unary_expr(const UnaryExpr &group);
-  LoxElement &evaluate_variable_expr(const VariableExpr &var);
+  // A nil that isn't in any variable when "var" is undefined
+  const LoxElement &evaluate_variable_expr(const VariableExpr &var);
   LoxElement evaluate_assign_expr(const AssignExpr &assign);
   LoxElement evaluate_logical_expr(const LogicalExpr &logical);
   LoxElement evaluate_call_expr(const CallExpr &call);
+  // The checks raise the runtime error and return false if they fail
   bool check_number_operand(const Token &tok, const LoxElement &right);
   bool check_bool_operand(const Token &tok, const LoxElement &right);
   bool check_number_operands(const Token &tok, const LoxElement &left,
                              const LoxElement &right);
 
-  void run_print_stmt(const Print &print);
-  void run_expression_stmt(const Expression &expression);
-  void run_var_stmt(const Var &var);
-  void run_block_stmt(const Block &block);
-  void run_if_stmt(const IfStmt &if_stmt);
-  void run_while_stmt(const WhileStmt &while_stmt);
-  void run_func_stmt(const FuncStmt *func_stmt);
-  // Runs the return statement, _throw_ing the returned value.
-  // Yes, this is terrible for performance, however, if we wanted performance we
-  // would make a bytecode VM, not an interpreter, but this is fine for now
-  void run_return_stmt(const ReturnStmt &return_stmt);
-  void execute(const Stmt &stmt);
+  // Evaluates "expr" without recursing natively, with eval_frames as the
+  // continuation stack and eval_operands holding the evaluated subexpressions
+  LoxElement evaluate_iteratively(const Expr &expr);
+  // Schedules "expr", evaluating it right away if it's a leaf. Raises a
+  // runtime error beyond max_eval_depth frames
+  void push_eval_frame(const Expr &expr);
+  LoxElement pop_operand();
+
+  Completion run_print_stmt(const Print &print);
+  Completion run_expression_stmt(const Expression &expression);
+  Completion run_var_stmt(const Var &var);
+  Completion run_block_stmt(const Block &block);
+  Completion run_if_stmt(const IfStmt &if_stmt);
+  Completion run_while_stmt(const WhileStmt &while_stmt);
+  Completion run_func_stmt(const FuncStmt *func_stmt);
+  Completion run_return_stmt(const ReturnStmt &return_stmt);
+  Completion execute(const Stmt &stmt);
 
 public:
   Env globals;
-  Env env;
+  ValueStack locals;
+  SpecStats spec_stats;
+  // What the return statement being completed returns, see Completion
+  LoxElement return_value = LoxElement::nil();
+  // The keyword of that return statement, where a return outside of any
+  // function is reported
+  const Token *return_keyword = nullptr;
+  // nullptr unless the JIT is enabled (and supported)
+  std::unique_ptr<Jit> jit;
+  // nullptr unless the tracing JIT is enabled (and supported)
+  std::unique_ptr<TraceJit> tracer;
 
-  Interpreter();
-  void interpret(const std::vector<Stmt> &statements);
+  Interpreter(Engine engine = Engine::ENGINE_TREE);
+  // Compiles functions to native code after "threshold" calls, if we can
+  void enable_jit(long threshold);
+  // Compiles hot loops to native code, see trace_jit.hpp. Only the tree
+  // engine records traces
+  void enable_trace_jit();
+  // Evaluates expressions with an explicit, heap allocated stack instead of
+  // native recursion, so nesting is only bounded by "max_depth" pending
+  // subexpressions (a runtime error beyond that). Tree engine only
+  void enable_stack_eval(size_t max_depth);
+  // Defines "allocations()", the number of heap allocations made so far
+  void enable_alloc_counter();
+  // What the JIT tracks for "decl", nullptr if it isn't enabled
+  JitFunction *jit_function_for(const FuncStmt *decl);
+  // Runs a program, reporting runtime errors. Returns false after one
+  bool interpret(const std::vector<Stmt> &statements);
+  // Gets a program ready to be called into without running any of it: its
+  // literals are resolved and, for the closure engine, its functions
+  // compiled. The program has to outlive us
+  void prepare(const std::vector<Stmt> &statements);
+  // What running the declaration "decl" defines, "decl" being part of a
+  // program we prepared or interpreted
+  LoxFunction *make_function(const FuncStmt *decl);
+  // Records a runtime error at "where", unless one is already propagating.
+  // Until it's taken, evaluating returns nil without doing anything that
+  // can be observed and executing completes with Completion::ERROR.
+  // Cold, so the paths raising errors stay out of the hot code
+  [[gnu::cold]] void raise(const Token &where, std::string why);
+  [[gnu::cold]] void raise(const Token &where, const char *why);
+  bool failed() const { return __builtin_expect(this->error.has_value(), false); }
+  // What executing an expression statement completes with
+  Completion status() const { return failed() ? Completion::ERROR : Completion::NORMAL; }
+  // The error being propagated, which stops propagating
+  LoxRuntimeErr take_error();
+  // Defines a local, raising "Stack overflow." if the stack is full
+  void define_local(const Token &name, LoxElement val);
+  // Pushes an argument of the call at "paren", see call_value
+  void push_arg(const Token &paren, LoxElement arg);
   LoxElement evaluate(const Expr &expr);
-  // Runs the given statements in the given environment, at the end
-  // re-establishing the interpreter's "interp->env" as "env.enclosing" (the one
-  // we were passed in)
-  void execute_block(const std::vector<Stmt> &statements, Env env);
-};
-
-class ReturnException : public std::exception {
-public:
-  LoxElement value;
-  ReturnException(LoxElement value);
-  ReturnException(ReturnException &&to_move) = default;
-  ~ReturnException() = default;
+  // Runs the given statements in the current scope, stopping at a return
+  Completion execute_statements(const std::vector<Stmt> &statements);
+  // Same as above, for a block compiled by the closure engine
+  Completion execute_statements(const CompiledBlock &block);
+  // What a print statement does with its value
+  void print(const LoxElement &value);
+  // Calls "callee" with the arguments pushed on "locals" from "first_arg"
+  // on (see ValueStack::push_arg), checking that it is callable and that the
+  // arity matches. "paren" is used for diagnostics. The arguments are popped
+  // however the call ends
+  LoxElement call_value(const Token &paren, const LoxElement &callee, size_t first_arg);
+  ~Interpreter();
 };
 
 #endif // INTERPRETER_H_
@@ -0,0 +1,503 @@
+#include "jit.hpp"
+
+#include <cstring>
+#include <exception>
+#include <unistd.h>
+
+#include "../util.hpp"
+#include "interpreter.hpp"
+#include "x64_assembler.hpp"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED 1
+#include <sys/mman.h>
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+// After this many bailouts we stop entering the native code of a function, it
+// obviously keeps running into things it can't handle
+constexpr long JIT_MAX_BAILOUTS = 16;
+constexpr size_t JIT_MAX_ARGS = 256;
+
+JitFunction::JitFunction(const FuncStmt *decl) : decl(decl) {}
+
+// Thrown (and caught right away) when a function uses something outside of
+// the subset we compile
+class NotCompilable : public std::exception {};
+
+// The static type of a compiled expression. Numbers are produced in xmm0,
+// booleans as 0/1 in eax
+enum JitTy { JIT_NUM, JIT_BOOL };
+
+/* Compiles one function. The frame looks like this:
+ *   [rbp - 8]              the "result" pointer we were passed
+ *   [rbp - 16 - 8 * slot]  one double per slot: first every local (parameters
+ *                          and vars), then the temporaries
+ * Locals are resolved statically, which matches what the interpreter does at
+ * runtime since a function can only ever see its own scopes. */
+class FunctionCompiler {
+private:
+  Interpreter *interp;
+  const FuncStmt *decl;
+  X64Assembler as;
+  std::vector<std::unordered_map<std::string, int>> scopes;
+  int n_locals = 0;
+  int max_locals = 0;
+  int temps = 0;
+  int max_temps = 0;
+  int entry;
+  int bail;
+
+  static int32_t disp(int slot) { return -16 - 8 * slot; }
+
+  static int count_vars(const Stmt &stmt) {
+    switch (stmt.ty) {
+      case StmtTy::STMT_VAR:
+        return 1;
+      case StmtTy::STMT_BLOCK: {
+        int n = 0;
+        for (auto &st : stmt.block.statements) {
+          n += count_vars(st);
+        }
+        return n;
+      }
+      case StmtTy::STMT_IF:
+        return count_vars(*stmt.if_stmt.then_branch) +
+               (stmt.if_stmt.else_branch ? count_vars(*stmt.if_stmt.else_branch) : 0);
+      case StmtTy::STMT_WHILE:
+        return count_vars(*stmt.while_stmt.body);
+      default:
+        return 0;
+    }
+  }
+
+  int push_temps(int n) {
+    int first = this->max_locals + this->temps;
+    this->temps += n;
+    if (this->temps > this->max_temps) {
+      this->max_temps = this->temps;
+    }
+    return first;
+  }
+
+  void pop_temps(int n) { this->temps -= n; }
+
+  void declare(const std::string &name) {
+    auto &scope = this->scopes.back();
+    if (scope.find(name) == scope.end()) {
+      scope[name] = this->n_locals++;
+    }
+  }
+
+  int resolve(const Token &name) {
+    // The interpreter looks at the globals first, whatever the local scopes say
+    if (this->interp->globals.contains(name)) {
+      throw NotCompilable{};
+    }
+    for (auto it = this->scopes.rbegin(); it != this->scopes.rend(); it++) {
+      auto found = it->find(name.lexeme);
+      if (found != it->end()) {
+        return found->second;
+      }
+    }
+    throw NotCompilable{};
+  }
+
+  bool is_self(const Expr &callee) {
+    if (callee.ty != ExprTy::VAR_EXPR) {
+      return false;
+    }
+    auto &name = callee.var_expr.name;
+    if (name.lexeme != this->decl->name.lexeme || this->interp->globals.contains(name)) {
+      return false;
+    }
+    // Shadowed by a local
+    for (auto &scope : this->scopes) {
+      if (scope.find(name.lexeme) != scope.end()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  JitTy number(const Expr &expr) {
+    if (this->expr(expr) != JitTy::JIT_NUM) {
+      throw NotCompilable{};
+    }
+    return JitTy::JIT_NUM;
+  }
+
+  JitTy boolean(const Expr &expr) {
+    if (this->expr(expr) != JitTy::JIT_BOOL) {
+      throw NotCompilable{};
+    }
+    return JitTy::JIT_BOOL;
+  }
+
+  // Evaluates "left" and "right" into xmm0 and xmm1
+  void operands(const BinaryExpr &binary) {
+    number(*binary.left);
+    int tmp = push_temps(1);
+    as.movsd_store(X64Reg::RBP, disp(tmp), X64Xmm::XMM0);
+    number(*binary.right);
+    as.movapd(X64Xmm::XMM1, X64Xmm::XMM0);
+    as.movsd_load(X64Xmm::XMM0, X64Reg::RBP, disp(tmp));
+    pop_temps(1);
+  }
+
+  void compare(X64Xmm a, X64Xmm b, X64Cond cond) {
+    as.ucomisd(a, b);
+    as.setcc_al(cond);
+    as.movzx_eax_al();
+  }
+
+  JitTy binary(const BinaryExpr &binary) {
+    operands(binary);
+    switch (binary.op.type) {
+      case TokenType::PLUS:
+        as.addsd(X64Xmm::XMM0, X64Xmm::XMM1);
+        return JitTy::JIT_NUM;
+      case TokenType::MINUS:
+        as.subsd(X64Xmm::XMM0, X64Xmm::XMM1);
+        return JitTy::JIT_NUM;
+      case TokenType::STAR:
+        as.mulsd(X64Xmm::XMM0, X64Xmm::XMM1);
+        return JitTy::JIT_NUM;
+      case TokenType::SLASH: {
+        // Let the interpreter report the division by zero (-0.0 included,
+        // NaN isn't equal to zero)
+        int ok = as.new_label();
+        as.xorpd(X64Xmm::XMM2, X64Xmm::XMM2);
+        as.ucomisd(X64Xmm::XMM1, X64Xmm::XMM2);
+        as.jcc(X64Cond::COND_P, ok);
+        as.jcc(X64Cond::COND_E, this->bail);
+        as.bind(ok);
+        as.divsd(X64Xmm::XMM0, X64Xmm::XMM1);
+        return JitTy::JIT_NUM;
+      }
+      // Unordered compares set CF and ZF, so "above" style conditions are
+      // false on NaN like the C++ operators the interpreter uses
+      case TokenType::GREATER:
+        compare(X64Xmm::XMM0, X64Xmm::XMM1, X64Cond::COND_A);
+        return JitTy::JIT_BOOL;
+      case TokenType::GREATER_EQUAL:
+        compare(X64Xmm::XMM0, X64Xmm::XMM1, X64Cond::COND_AE);
+        return JitTy::JIT_BOOL;
+      case TokenType::LESS:
+        compare(X64Xmm::XMM1, X64Xmm::XMM0, X64Cond::COND_A);
+        return JitTy::JIT_BOOL;
+      case TokenType::LESS_EQUAL:
+        compare(X64Xmm::XMM1, X64Xmm::XMM0, X64Cond::COND_AE);
+        return JitTy::JIT_BOOL;
+      case TokenType::EQUAL_EQUAL:
+        as.ucomisd(X64Xmm::XMM0, X64Xmm::XMM1);
+        as.setcc_al(X64Cond::COND_E);
+        as.setcc_cl(X64Cond::COND_NP);
+        as.and_al_cl();
+        as.movzx_eax_al();
+        return JitTy::JIT_BOOL;
+      case TokenType::BANG_EQUAL:
+        as.ucomisd(X64Xmm::XMM0, X64Xmm::XMM1);
+        as.setcc_al(X64Cond::COND_NE);
+        as.setcc_cl(X64Cond::COND_P);
+        as.or_al_cl();
+        as.movzx_eax_al();
+        return JitTy::JIT_BOOL;
+      default:
+        throw NotCompilable{};
+    }
+  }
+
+  JitTy call(const CallExpr &call) {
+    if (!is_self(*call.callee) || call.args.size() != this->decl->params.size()) {
+      throw NotCompilable{};
+    }
+    // The arguments must be laid out in ascending addresses, and slots grow
+    // downwards, so argument k lives in slot "first + n - 1 - k". The slot
+    // right after them receives the result
+    int n = call.args.size();
+    int first = push_temps(n + 1);
+    int result = first + n;
+    for (int k = 0; k < n; k++) {
+      number(call.args[k]);
+      as.movsd_store(X64Reg::RBP, disp(first + n - 1 - k), X64Xmm::XMM0);
+    }
+    as.lea(X64Reg::RDI, X64Reg::RBP, disp(first + n - 1));
+    as.lea(X64Reg::RSI, X64Reg::RBP, disp(result));
+    as.call(this->entry);
+    as.test_eax_eax();
+    as.jcc(X64Cond::COND_E, this->bail);
+    as.movsd_load(X64Xmm::XMM0, X64Reg::RBP, disp(result));
+    pop_temps(n + 1);
+    return JitTy::JIT_NUM;
+  }
+
+  JitTy expr(const Expr &expr) {
+    switch (expr.ty) {
+      case ExprTy::LITERAL: {
+        if (expr.lit.lit.ty != LiteralTy::LIT_NUMBER) {
+          throw NotCompilable{};
+        }
+        uint64_t bits;
+        memcpy(&bits, &expr.lit.lit.number, sizeof(bits));
+        as.mov_rax_imm64(bits);
+        as.movq_xmm_rax(X64Xmm::XMM0);
+        return JitTy::JIT_NUM;
+      }
+      case ExprTy::GROUPING:
+        return this->expr(*expr.group.expression);
+      case ExprTy::VAR_EXPR:
+        as.movsd_load(X64Xmm::XMM0, X64Reg::RBP, disp(resolve(expr.var_expr.name)));
+        return JitTy::JIT_NUM;
+      case ExprTy::ASSIGN_EXPR: {
+        int slot = resolve(expr.ass_expr.name);
+        number(*expr.ass_expr.value);
+        as.movsd_store(X64Reg::RBP, disp(slot), X64Xmm::XMM0);
+        return JitTy::JIT_NUM;
+      }
+      case ExprTy::UNARY:
+        if (expr.unary.op.type == TokenType::MINUS) {
+          number(*expr.unary.right);
+          as.mov_rax_imm64(0x8000000000000000ULL);
+          as.movq_xmm_rax(X64Xmm::XMM1);
+          as.xorpd(X64Xmm::XMM0, X64Xmm::XMM1);
+          return JitTy::JIT_NUM;
+        }
+        boolean(*expr.unary.right);
+        as.xor_eax_imm8(1);
+        return JitTy::JIT_BOOL;
+      case ExprTy::BINARY:
+        return binary(expr.bin);
+      case ExprTy::LOGICAL_EXPR: {
+        // Only boolean and/or, so the result is always 0/1 in eax
+        int done = as.new_label();
+        boolean(*expr.logical.left);
+        as.test_eax_eax();
+        as.jcc(expr.logical.op.type == TokenType::OR ? X64Cond::COND_NE : X64Cond::COND_E, done);
+        boolean(*expr.logical.right);
+        as.bind(done);
+        return JitTy::JIT_BOOL;
+      }
+      case ExprTy::CALL_EXPR:
+        return call(expr.call);
+      default:
+        throw NotCompilable{};
+    }
+  }
+
+  // Jumps to "if_false" if "cond" isn't truthy. Numbers always are
+  void branch_unless(const Expr &cond, int if_false) {
+    if (expr(cond) == JitTy::JIT_BOOL) {
+      as.test_eax_eax();
+      as.jcc(X64Cond::COND_E, if_false);
+    }
+  }
+
+  void stmt(const Stmt &stmt) {
+    switch (stmt.ty) {
+      case StmtTy::STMT_EXPR:
+        expr(stmt.expression.expr);
+        break;
+      case StmtTy::STMT_VAR:
+        if (stmt.var.initializer.is_nil()) {
+          throw NotCompilable{};
+        }
+        number(stmt.var.initializer);
+        declare(stmt.var.name.lexeme);
+        as.movsd_store(X64Reg::RBP, disp(resolve(stmt.var.name)), X64Xmm::XMM0);
+        break;
+      case StmtTy::STMT_BLOCK:
+        this->scopes.emplace_back();
+        for (auto &st : stmt.block.statements) {
+          this->stmt(st);
+        }
+        this->scopes.pop_back();
+        break;
+      case StmtTy::STMT_IF: {
+        int else_branch = as.new_label();
+        int done = as.new_label();
+        branch_unless(stmt.if_stmt.condition, else_branch);
+        this->stmt(*stmt.if_stmt.then_branch);
+        as.jmp(done);
+        as.bind(else_branch);
+        if (stmt.if_stmt.else_branch != nullptr) {
+          this->stmt(*stmt.if_stmt.else_branch);
+        }
+        as.bind(done);
+        break;
+      }
+      case StmtTy::STMT_WHILE: {
+        int loop = as.new_label();
+        int done = as.new_label();
+        as.bind(loop);
+        branch_unless(stmt.while_stmt.cond, done);
+        this->stmt(*stmt.while_stmt.body);
+        as.jmp(loop);
+        as.bind(done);
+        break;
+      }
+      case StmtTy::STMT_RETURN:
+        // Returning nil or a boolean is left to the interpreter
+        if (stmt.return_stmt.value.is_nil() || expr(stmt.return_stmt.value) != JitTy::JIT_NUM) {
+          as.jmp(this->bail);
+          break;
+        }
+        as.load64(X64Reg::RAX, X64Reg::RBP, -8);
+        as.movsd_store(X64Reg::RAX, 0, X64Xmm::XMM0);
+        as.mov_eax_imm(1);
+        as.leave();
+        as.ret();
+        break;
+      default:
+        throw NotCompilable{};
+    }
+  }
+
+public:
+  FunctionCompiler(Interpreter *interp, const FuncStmt *decl)
+      : interp(interp), decl(decl) {}
+
+  // Throws NotCompilable if the function is outside of the subset
+  std::vector<uint8_t> compile() {
+    this->entry = as.new_label();
+    this->bail = as.new_label();
+    this->max_locals = this->decl->params.size();
+    for (auto &st : this->decl->body.statements) {
+      this->max_locals += count_vars(st);
+    }
+
+    this->scopes.emplace_back();
+    for (auto &param : this->decl->params) {
+      // The function's own name is defined after its parameters, hiding them
+      if (param.lexeme == this->decl->name.lexeme) {
+        throw NotCompilable{};
+      }
+      declare(param.lexeme);
+    }
+
+    as.bind(this->entry);
+    as.push(X64Reg::RBP);
+    as.mov_rbp_rsp();
+    size_t frame = as.sub_rsp(0);
+    as.store64(X64Reg::RBP, -8, X64Reg::RSI);
+    for (size_t i = 0; i < this->decl->params.size(); i++) {
+      as.movsd_load(X64Xmm::XMM0, X64Reg::RDI, 8 * i);
+      as.movsd_store(X64Reg::RBP, disp(i), X64Xmm::XMM0);
+    }
+    for (auto &st : this->decl->body.statements) {
+      stmt(st);
+    }
+    // Falling off the end returns nil
+    as.bind(this->bail);
+    as.xor_eax_eax();
+    as.leave();
+    as.ret();
+
+    // Keep rsp 16-byte aligned for our own calls: it is after "push rbp"
+    int32_t size = 8 * (2 + this->max_locals + this->max_temps);
+    as.patch32(frame, (size + 15) & ~15);
+    return as.finish();
+  }
+};
+
+bool CodeHeap::write_perf_map = false;
+
+void *CodeHeap::install(const std::vector<uint8_t> &code, const std::string &name) {
+#if JIT_SUPPORTED
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t len = (code.size() + page - 1) / page * page;
+  void *mem = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return nullptr;
+  }
+  memcpy(mem, code.data(), code.size());
+  // Never writable and executable at the same time
+  if (mprotect(mem, len, PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem, len);
+    return nullptr;
+  }
+  this->mappings.push_back({mem, len});
+
+  if (write_perf_map && this->perf_map_pid != getpid()) {
+    if (this->perf_map != nullptr) {
+      fclose(this->perf_map);
+    }
+    this->perf_map_pid = getpid();
+    std::string path = "/tmp/perf-" + std::to_string(this->perf_map_pid) + ".map";
+    this->perf_map = fopen(path.c_str(), "a");
+  }
+  if (this->perf_map != nullptr) {
+    fprintf(this->perf_map, "%lx %zx jlox::%s\n", (unsigned long) mem, code.size(), name.c_str());
+    fflush(this->perf_map);
+  }
+  return mem;
+#else
+  return nullptr;
+#endif
+}
+
+CodeHeap::~CodeHeap() {
+#if JIT_SUPPORTED
+  for (auto &mapping : this->mappings) {
+    munmap(mapping.first, mapping.second);
+  }
+#endif
+  if (this->perf_map != nullptr) {
+    fclose(this->perf_map);
+  }
+}
+
+bool Jit::supported() { return JIT_SUPPORTED; }
+
+Jit::Jit(long threshold) : threshold(threshold) {}
+
+JitFunction *Jit::function_for(const FuncStmt *decl) {
+  return &this->functions.try_emplace(decl, decl).first->second;
+}
+
+void Jit::compile(Interpreter *interp, JitFunction &fn) {
+  fn.state = JitState::JIT_FAILED;
+  if (!supported() || fn.decl->params.size() > JIT_MAX_ARGS) {
+    return;
+  }
+  std::vector<uint8_t> code;
+  try {
+    code = FunctionCompiler(interp, fn.decl).compile();
+  } catch (NotCompilable &nc) {
+    return;
+  }
+  fn.code = (JitCode) this->code_heap.install(code, fn.decl->name.lexeme);
+  if (fn.code != nullptr) {
+    fn.state = JitState::JIT_COMPILED;
+  }
+}
+
+bool Jit::try_call(Interpreter *interp, JitFunction &fn,
+                   std::span<const LoxElement> args, double &result) {
+  if (fn.state == JitState::JIT_COLD) {
+    if (++fn.calls < this->threshold) {
+      return false;
+    }
+    compile(interp, fn);
+  }
+  if (fn.state != JitState::JIT_COMPILED) {
+    return false;
+  }
+
+  double values[JIT_MAX_ARGS];
+  for (size_t i = 0; i < args.size(); i++) {
+    if (!args[i].is_number()) {
+      return false;
+    }
+    values[i] = args[i].lox_number();
+  }
+  if (fn.code(values, &result)) {
+    return true;
+  }
+  if (++fn.bailouts >= JIT_MAX_BAILOUTS) {
+    fn.state = JitState::JIT_FAILED;
+  }
+  return false;
+}
+
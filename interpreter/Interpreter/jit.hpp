@@ -0,0 +1,94 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include <cstdio>
+#include <sys/types.h>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "../LexParse/stmt.hpp"
+
+class Interpreter;
+class LoxElement;
+
+/* A baseline template JIT for hot number-crunching functions (Linux x86-64
+ * only, no external dependencies).
+ *
+ * Once a function has been called "threshold" times we try to compile it
+ * straight to machine code. Only a pure subset of Lox is compiled: numeric
+ * parameters and locals, number literals, arithmetic, comparisons, and/or/!,
+ * if/while/blocks, assignments to locals and calls to the function itself.
+ * Anything else (printing, strings, calling other functions, touching
+ * variables outside the function...) makes the function uncompilable and it
+ * stays in the interpreter forever.
+ *
+ * Because compiled functions can't have side effects, bailing out is simple:
+ * whenever the native code meets something it can't handle (a division by
+ * zero, returning a non-number, falling off the end of the body) it just gives
+ * up and the interpreter re-runs the whole call from the start, which also
+ * takes care of producing the exact runtime error. Calls with non-number
+ * arguments never enter native code.
+ *
+ * With --perf-map, every compiled function is registered in
+ * /tmp/perf-<pid>.map so "perf" can symbolize JITed frames. */
+
+// Executable memory for JITed code, shared by both JITs. Also takes care of
+// registering everything in /tmp/perf-<pid>.map when asked to
+class CodeHeap {
+private:
+  // Executable mappings we own, (address, length)
+  std::vector<std::pair<void *, size_t>> mappings;
+  FILE *perf_map = nullptr;
+  // Whose map "perf_map" is: a forked child has to write its own
+  pid_t perf_map_pid = 0;
+
+public:
+  // Set by --perf-map. Nothing is written (or created) in /tmp otherwise
+  static bool write_perf_map;
+  // Copies "code" into fresh executable memory, returns nullptr on failure
+  void *install(const std::vector<uint8_t> &code, const std::string &name);
+  ~CodeHeap();
+};
+
+// Native code of a compiled function: "args" holds one double per parameter
+// and the result is written to "*result". Returns 0 if the code bailed out
+typedef int (*JitCode)(const double *args, double *result);
+
+enum JitState { JIT_COLD, JIT_COMPILED, JIT_FAILED };
+
+// What the JIT knows about one function declaration. Shared by every
+// LoxFunction created from the same declaration
+class JitFunction {
+public:
+  const FuncStmt *decl;
+  long calls = 0;
+  long bailouts = 0;
+  JitState state = JitState::JIT_COLD;
+  JitCode code = nullptr;
+  JitFunction(const FuncStmt *decl);
+};
+
+class Jit {
+private:
+  long threshold;
+  std::unordered_map<const FuncStmt *, JitFunction> functions;
+  CodeHeap code_heap;
+
+  void compile(Interpreter *interp, JitFunction &fn);
+
+public:
+  // Whether we know how to emit code for the machine we're running on
+  static bool supported();
+
+  Jit(long threshold);
+  JitFunction *function_for(const FuncStmt *decl);
+  // Counts a call to "fn" (compiling it once it gets hot) and runs it natively
+  // if we can. Returns false if the interpreter has to run the call instead
+  bool try_call(Interpreter *interp, JitFunction &fn,
+                std::span<const LoxElement> args, double &result);
+};
+
+#endif // JIT_H_
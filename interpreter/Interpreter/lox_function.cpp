@@ -1,44 +1,53 @@
 #include "lox_function.hpp"
 #include "interpreter.hpp"
+#include "jit.hpp"
 
-LoxFunction::LoxFunction(const FuncStmt *decl) : decl(decl) {}
+LoxFunction::LoxFunction(const FuncStmt *decl, const CompiledBlock *compiled_body,
+                         JitFunction *jit)
+    : LoxCallable(CallableKind::USER_FN), decl(decl), compiled_body(compiled_body), jit(jit) {}
 
-int LoxFunction::arity() { return this->decl->params.size(); }
+int LoxFunction::arity() const { return this->decl->params.size(); }
 
-LoxFunction LoxFunction::copy() const { return LoxFunction(this->decl); }
+LoxFunction LoxFunction::copy() const {
+  return LoxFunction(this->decl, this->compiled_body, this->jit);
+}
 
-LoxFunction::LoxFunction(LoxFunction &&to_move) {
+LoxFunction::LoxFunction(LoxFunction &&to_move) : LoxCallable(CallableKind::USER_FN) {
   this->decl = to_move.decl;
+  this->compiled_body = to_move.compiled_body;
+  this->jit = to_move.jit;
   to_move.decl = nullptr;
+  to_move.compiled_body = nullptr;
+  to_move.jit = nullptr;
 }
 
-LoxElement LoxFunction::call(Interpreter *interp,
-                             std::vector<LoxElement> args) {
-  auto before = std::move(interp->env);
-  Env env{};
-  auto params_size = this->decl->params.size();
-  for (int i = 0; i < params_size; i++) {
-    env.define(this->decl->params[i].lexeme, std::move(args[i]));
+LoxElement LoxFunction::call(Interpreter *interp, size_t first_arg) {
+  if (this->jit != nullptr) {
+    double result;
+    if (interp->jit->try_call(interp, *this->jit, interp->locals.args(first_arg), result)) {
+      return LoxElement(result);
+    }
   }
 
-  // Enable recursion
-  LoxCallable *this_fn = new LoxFunction(this->decl);
-  env.define(this->decl->name.lexeme, LoxElement(this_fn));
-
-  try {
-    interp->execute_block(this->decl->body.statements, std::move(env));
-    // Now, the current environment is the "env.enclosing" which is NULL
-    // So we re-establish the environment from before
-  } catch (ReturnException *ret) {
-    auto returned = std::move(ret->value);
-    delete ret;
-    interp->env = std::move(before);
-    return returned;
+  // The parameters (the arguments, already in place) and the body share the
+  // frame's scope, which is left on returning (or erroring) however deep in
+  // blocks we are
+  ValueStack::Scope frame{interp->locals, first_arg, this->decl->params};
+
+  // Enable recursion: the frame gets another reference to us, the function
+  // being called, rather than a copy
+  this->refs++;
+  interp->define_local(this->decl->name, LoxElement(static_cast<LoxCallable *>(this)));
+  if (interp->failed()) {
+    return LoxElement::nil();
   }
-  interp->env = std::move(before);
 
-  // FIXME: Do we need to store interp->env and re-establish that and move
-  // globals to "globals"?
+  Completion completion = this->compiled_body != nullptr
+                              ? interp->execute_statements(*this->compiled_body)
+                              : interp->execute_statements(this->decl->body.statements);
+  if (completion == Completion::RETURN) {
+    return std::move(interp->return_value);
+  }
   return LoxElement::nil();
 }
 
@@ -6,13 +6,25 @@
 #include "interpreter.hpp"
 #include "../LexParse/stmt.hpp"
 
+class CompiledBlock;
+class JitFunction;
+
 class LoxFunction : public LoxCallable {
 private:
   const FuncStmt *decl;
+  // The body as compiled by the closure engine, nullptr when tree-walking
+  const CompiledBlock *compiled_body;
+  // Call counting and native code, shared by every LoxFunction of "decl".
+  // nullptr when the JIT is disabled
+  JitFunction *jit;
 public:
-  LoxFunction(const FuncStmt *decl);
-  int arity();
-  LoxElement call(Interpreter *interp, std::vector<LoxElement> args);
+  LoxFunction(const FuncStmt *decl, const CompiledBlock *compiled_body = nullptr,
+              JitFunction *jit = nullptr);
+  int arity() const;
+  const FuncStmt *declaration() const { return this->decl; }
+  // The arguments are the slots of interp->locals from "first_arg" on, they
+  // become the parameters of the call's frame
+  LoxElement call(Interpreter *interp, size_t first_arg);
   std::string to_string() const;
   LoxFunction(LoxFunction &&to_move);
   LoxFunction copy() const;
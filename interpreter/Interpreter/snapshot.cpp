@@ -0,0 +1,282 @@
+#include "snapshot.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../util.hpp"
+#include "lox_function.hpp"
+#include "../LexParse/parser.hpp"
+#include "../LexParse/scanner.hpp"
+
+/* The image is, in native byte order:
+ *   MAGIC
+ *   u64 source length, the source
+ *   u64 slot count, then per slot: u64 name length, the name, a SlotKind
+ *     and its payload: a u8 for SLOT_BOOL, the u64 bits of a SLOT_NUMBER,
+ *     u64 length and characters for SLOT_STRING and SLOT_NATIVE (the
+ *     global's name), the u64 index of the declaration for SLOT_FUNCTION */
+static constexpr char MAGIC[8] = {'j', 'l', 'o', 'x', 'i', 'm', 'g', '1'};
+
+enum SlotKind : uint8_t { SLOT_NIL, SLOT_BOOL, SLOT_NUMBER, SLOT_STRING, SLOT_FUNCTION, SLOT_NATIVE };
+
+// Every function declaration of "statements", nested ones included, in the
+// order they appear in the source. An index into it identifies a declaration
+// across parses of the same source
+static void collect_functions(const std::vector<Stmt> &statements,
+                              std::vector<const FuncStmt *> &out);
+
+static void collect_functions(const Stmt &stmt, std::vector<const FuncStmt *> &out) {
+  switch (stmt.ty) {
+    case StmtTy::STMT_BLOCK:
+      collect_functions(stmt.block.statements, out);
+      break;
+    case StmtTy::STMT_IF:
+      collect_functions(*stmt.if_stmt.then_branch, out);
+      if (stmt.if_stmt.else_branch != nullptr) {
+        collect_functions(*stmt.if_stmt.else_branch, out);
+      }
+      break;
+    case StmtTy::STMT_WHILE:
+      collect_functions(*stmt.while_stmt.body, out);
+      break;
+    case StmtTy::STMT_FUNC:
+      out.push_back(stmt.func_stmt);
+      collect_functions(stmt.func_stmt->body.statements, out);
+      break;
+    default:
+      break;
+  }
+}
+
+static void collect_functions(const std::vector<Stmt> &statements,
+                              std::vector<const FuncStmt *> &out) {
+  for (auto &stmt : statements) {
+    collect_functions(stmt, out);
+  }
+}
+
+static void put_u64(std::string &out, uint64_t val) {
+  out.append(reinterpret_cast<const char *>(&val), sizeof(val));
+}
+
+static void put_str(std::string &out, std::string_view str) {
+  put_u64(out, str.size());
+  out.append(str);
+}
+
+bool Snapshot::save(const char *path, std::string_view source,
+                    const std::vector<Stmt> &statements, const Interpreter &interp) {
+  std::vector<const FuncStmt *> functions;
+  collect_functions(statements, functions);
+  std::unordered_map<const FuncStmt *, uint64_t> function_index;
+  for (size_t i = 0; i < functions.size(); i++) {
+    function_index.emplace(functions[i], i);
+  }
+
+  std::string image(MAGIC, sizeof(MAGIC));
+  put_str(image, source);
+  put_u64(image, interp.locals.size());
+  for (size_t slot = 0; slot < interp.locals.size(); slot++) {
+    put_str(image, interp.locals.name_at(slot));
+    const LoxElement &value = interp.locals.value_at(slot);
+    switch (value.ty()) {
+      case LoxTy::LOX_NIL:
+        image.push_back(SLOT_NIL);
+        break;
+      case LoxTy::LOX_BOOL:
+        image.push_back(SLOT_BOOL);
+        image.push_back(value.lox_bool());
+        break;
+      case LoxTy::LOX_NUMBER:
+        image.push_back(SLOT_NUMBER);
+        put_u64(image, std::bit_cast<uint64_t>(value.lox_number()));
+        break;
+      case LoxTy::LOX_STRING:
+        image.push_back(SLOT_STRING);
+        put_str(image, value.lox_str());
+        break;
+      case LoxTy::LOX_CALLABLE:
+        if (value.callable()->kind == CallableKind::USER_FN) {
+          // Only the prelude was run, every function comes from it
+          auto *fn = static_cast<LoxFunction *>(value.callable());
+          image.push_back(SLOT_FUNCTION);
+          put_u64(image, function_index.at(fn->declaration()));
+        } else {
+          const std::string *global = interp.globals.name_of(value.callable());
+          ASSERT_COND(global != nullptr, "Native function that isn't a global");
+          image.push_back(SLOT_NATIVE);
+          put_str(image, *global);
+        }
+        break;
+      default:
+        UNREACHABLE();
+    }
+  }
+
+  FILE *out = fopen(path, "wb");
+  if (!out) {
+    return false;
+  }
+  bool written = fwrite(image.data(), 1, image.size(), out) == image.size();
+  return fclose(out) == 0 && written;
+}
+
+// The image, mapped in for as long as we read it
+class ImageMapping {
+public:
+  const char *data = nullptr;
+  size_t len = 0;
+  ImageMapping(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped != MAP_FAILED) {
+        this->data = static_cast<const char *>(mapped);
+        this->len = st.st_size;
+      }
+    }
+    close(fd);
+  }
+  ~ImageMapping() {
+    if (this->data != nullptr) {
+      munmap(const_cast<char *>(this->data), this->len);
+    }
+  }
+  ImageMapping(const ImageMapping &) = delete;
+  ImageMapping &operator=(const ImageMapping &) = delete;
+};
+
+// Reads the image front to back. A read past its end fails, leaving "ok"
+// false from then on
+class ImageReader {
+private:
+  const char *at;
+  const char *end;
+
+public:
+  bool ok = true;
+  ImageReader(const char *data, size_t len) : at(data), end(data + len) {}
+  bool done() const { return this->at == this->end; }
+  std::string_view bytes(uint64_t len) {
+    if (!this->ok || len > (uint64_t) (this->end - this->at)) {
+      this->ok = false;
+      return {};
+    }
+    std::string_view got(this->at, len);
+    this->at += len;
+    return got;
+  }
+  uint64_t u64() {
+    uint64_t val = 0;
+    std::string_view got = bytes(sizeof(val));
+    if (this->ok) {
+      memcpy(&val, got.data(), sizeof(val));
+    }
+    return val;
+  }
+  uint8_t u8() {
+    std::string_view got = bytes(1);
+    return this->ok ? (uint8_t) got[0] : 0;
+  }
+  std::string_view str() { return bytes(u64()); }
+};
+
+bool Snapshot::restore(const char *path, Interpreter &interp, std::string &err) {
+  ImageMapping image(path);
+  if (image.data == nullptr) {
+    err = std::string("Could not open ") + path;
+    return false;
+  }
+  ImageReader in(image.data, image.len);
+  if (in.bytes(sizeof(MAGIC)) != std::string_view(MAGIC, sizeof(MAGIC))) {
+    err = std::string(path) + " is not a snapshot";
+    return false;
+  }
+  std::string_view source = in.str();
+  if (!in.ok) {
+    err = std::string(path) + " is truncated";
+    return false;
+  }
+  auto sc = Scanner(source.data(), source.size());
+  this->statements = Parser(sc.scan_tokens()).parse();
+  interp.prepare(this->statements);
+
+  std::vector<const FuncStmt *> functions;
+  collect_functions(this->statements, functions);
+  // Each slot was defined by a top level declaration, whose name the slot
+  // keeps pointing to
+  std::unordered_map<std::string_view, const Token *> declared;
+  for (auto &stmt : this->statements) {
+    if (stmt.ty == StmtTy::STMT_VAR) {
+      declared.emplace(stmt.var.name.lexeme, &stmt.var.name);
+    } else if (stmt.ty == StmtTy::STMT_FUNC) {
+      declared.emplace(stmt.func_stmt->name.lexeme, &stmt.func_stmt->name);
+    }
+  }
+
+  size_t first_slot = interp.locals.size();
+  uint64_t slots = in.u64();
+  for (uint64_t slot = 0; in.ok && slot < slots; slot++) {
+    auto name = declared.find(in.str());
+    if (!in.ok || name == declared.end()) {
+      break;
+    }
+    LoxElement value = LoxElement::nil();
+    switch (in.u8()) {
+      case SLOT_NIL:
+        break;
+      case SLOT_BOOL:
+        value = LoxElement(in.u8() != 0);
+        break;
+      case SLOT_NUMBER:
+        value = LoxElement(std::bit_cast<double>(in.u64()));
+        break;
+      case SLOT_STRING:
+        value = LoxElement(in.str());
+        break;
+      case SLOT_FUNCTION: {
+        uint64_t index = in.u64();
+        in.ok = in.ok && index < functions.size();
+        if (in.ok) {
+          value = LoxElement(static_cast<LoxCallable *>(interp.make_function(functions[index])));
+        }
+        break;
+      }
+      case SLOT_NATIVE: {
+        std::string_view global = in.str();
+        LoxElement *native = in.ok ? interp.globals.find(global) : nullptr;
+        if (in.ok && native == nullptr) {
+          err = std::string(path) + " needs the native " + std::string(global);
+          return false;
+        }
+        if (in.ok) {
+          value = native->copy();
+        }
+        break;
+      }
+      default:
+        in.ok = false;
+        break;
+    }
+    if (!in.ok) {
+      break;
+    }
+    interp.define_local(*name->second, std::move(value));
+  }
+  if (!in.ok || interp.locals.size() - first_slot != slots || !in.done()) {
+    err = std::string(path) + " is corrupt";
+    return false;
+  }
+  return true;
+}
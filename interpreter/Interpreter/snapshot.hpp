@@ -0,0 +1,41 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "interpreter.hpp"
+#include "../LexParse/stmt.hpp"
+
+/* The state a prelude leaves behind, saved to an image so later runs start
+ * from it instead of running the prelude again (jlox --snapshot-out IMG
+ * prelude.lox, then jlox --snapshot-in IMG main.lox).
+ *
+ * What a program leaves behind is its top level: the variables and functions
+ * it defined, in order. The image holds the prelude's source and those slots,
+ * numbers and booleans as they are, strings by their characters, functions
+ * as which declaration of the prelude they were made from and natives by the
+ * global they came from. Restoring maps the image in, parses the source again
+ * (without running any of it) and defines the slots, so the main script sees
+ * them exactly as if the prelude had just run, but without the time running
+ * it took.
+ *
+ * An image is only meant to be read back by the jlox that wrote it */
+class Snapshot {
+private:
+  // The prelude, parsed again. Restored functions point into it
+  std::vector<Stmt> statements;
+
+public:
+  // Writes what running "statements" (parsed from "source") left on the top
+  // level of "interp" to "path". Returns false if it can't be written
+  static bool save(const char *path, std::string_view source,
+                   const std::vector<Stmt> &statements, const Interpreter &interp);
+  // Defines what the image at "path" holds on the top level of "interp",
+  // which has to go before we do. Returns false, with "err" saying why, if
+  // it isn't an image we can read
+  bool restore(const char *path, Interpreter &interp, std::string &err);
+};
+
+#endif // SNAPSHOT_H_
@@ -0,0 +1,712 @@
+#include "trace_jit.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <map>
+#include <tuple>
+
+#include "../util.hpp"
+#include "interpreter.hpp"
+#include "x64_assembler.hpp"
+
+// Back-edges before a loop is considered hot
+constexpr long TRACE_HOT_LOOP = 64;
+// Failed recordings (or untraceable paths) before we give up on a loop
+constexpr int TRACE_MAX_ATTEMPTS = 3;
+// A trace that keeps exiting early is slower than the interpreter, once it
+// has exited this many times it has to average this many iterations per exit
+// or the loop is recorded again
+constexpr long TRACE_MIN_EXITS = 16;
+constexpr long TRACE_MIN_ITERATIONS_PER_EXIT = 4;
+
+// Thrown (and caught right away) when the recorded iteration does something
+// we don't trace
+class NotTraceable : public std::exception {};
+
+enum TraceTy { TRACE_NUM, TRACE_BOOL, TRACE_NONE };
+
+enum TraceOp {
+  OP_CONST, OP_LOAD, OP_STORE, OP_NEG, OP_NOT,
+  OP_ADD, OP_SUB, OP_MUL, OP_DIV,
+  OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE, OP_AND, OP_OR,
+  OP_GUARD_TRUE, OP_GUARD_FALSE, OP_GUARD_NONZERO
+};
+
+// One instruction of a trace. Every instruction defines the value with its
+// own index: numbers as doubles, booleans as 0/1
+struct TraceIns {
+  TraceOp op;
+  TraceTy ty = TraceTy::TRACE_NONE;
+  int a = -1;
+  int b = -1;
+  double k = 0;  // OP_CONST
+  int var = -1;  // OP_LOAD, OP_STORE
+  int exit = 0;  // guards
+  bool dead = false;
+};
+
+static bool is_guard(TraceOp op) {
+  return op == TraceOp::OP_GUARD_TRUE || op == TraceOp::OP_GUARD_FALSE ||
+         op == TraceOp::OP_GUARD_NONZERO;
+}
+
+/* Turns the recorded iteration into a trace by walking the loop along the
+ * path the interpreter took. Variables declared inside the loop body only
+ * exist for one iteration, so they're just names for trace values; every
+ * other variable is "live in", loaded at most once per iteration and stored
+ * back at the very end of it. */
+class TraceBuilder {
+private:
+  Interpreter *interp;
+  const std::vector<std::pair<const IfStmt *, bool>> &branches;
+  size_t next_branch = 0;
+  std::vector<std::unordered_map<std::string, int>> scopes;
+  // Value of every live-in variable in the current iteration, -1 until read
+  std::vector<int> current;
+
+  int emit(TraceIns ins) {
+    this->ins.push_back(ins);
+    return this->ins.size() - 1;
+  }
+
+  int guard(TraceOp op, int value) {
+    TraceIns ins{op};
+    ins.a = value;
+    ins.exit = ++this->exits;
+    return emit(ins);
+  }
+
+  int variable(const Token &name) {
+    // The interpreter looks at the globals first, and those aren't numbers
+    if (this->interp->globals.contains(name)) {
+      throw NotTraceable{};
+    }
+    for (size_t i = 0; i < this->live_in.size(); i++) {
+      if (this->live_in[i] == name.lexeme) {
+        return i;
+      }
+    }
+    this->live_in.push_back(name.lexeme);
+    this->stored.push_back(false);
+    this->current.push_back(-1);
+    return this->live_in.size() - 1;
+  }
+
+  int *local(const std::string &name) {
+    for (auto it = this->scopes.rbegin(); it != this->scopes.rend(); it++) {
+      auto found = it->find(name);
+      if (found != it->end()) {
+        return &found->second;
+      }
+    }
+    return nullptr;
+  }
+
+  int read(const Token &name) {
+    if (int *value = local(name.lexeme)) {
+      return *value;
+    }
+    int var = variable(name);
+    if (this->current[var] < 0) {
+      TraceIns load{TraceOp::OP_LOAD, TraceTy::TRACE_NUM};
+      load.var = var;
+      this->current[var] = emit(load);
+    }
+    return this->current[var];
+  }
+
+  void write(const Token &name, int value) {
+    if (int *slot = local(name.lexeme)) {
+      *slot = value;
+      return;
+    }
+    // Whatever is stored outside the loop has to stay a number, that's what
+    // makes checking the types once on entry enough
+    if (this->ins[value].ty != TraceTy::TRACE_NUM) {
+      throw NotTraceable{};
+    }
+    int var = variable(name);
+    this->current[var] = value;
+    this->stored[var] = true;
+  }
+
+  int typed(const Expr &expr, TraceTy ty) {
+    int value = this->expr(expr);
+    if (this->ins[value].ty != ty) {
+      throw NotTraceable{};
+    }
+    return value;
+  }
+
+  int op(TraceOp op, TraceTy ty, int a, int b = -1) {
+    TraceIns ins{op, ty};
+    ins.a = a;
+    ins.b = b;
+    return emit(ins);
+  }
+
+  int binary(const BinaryExpr &binary) {
+    int a = typed(*binary.left, TraceTy::TRACE_NUM);
+    int b = typed(*binary.right, TraceTy::TRACE_NUM);
+    switch (binary.op.type) {
+      case TokenType::PLUS:
+        return op(TraceOp::OP_ADD, TraceTy::TRACE_NUM, a, b);
+      case TokenType::MINUS:
+        return op(TraceOp::OP_SUB, TraceTy::TRACE_NUM, a, b);
+      case TokenType::STAR:
+        return op(TraceOp::OP_MUL, TraceTy::TRACE_NUM, a, b);
+      case TokenType::SLASH:
+        guard(TraceOp::OP_GUARD_NONZERO, b);
+        return op(TraceOp::OP_DIV, TraceTy::TRACE_NUM, a, b);
+      case TokenType::LESS:
+        return op(TraceOp::OP_LT, TraceTy::TRACE_BOOL, a, b);
+      case TokenType::LESS_EQUAL:
+        return op(TraceOp::OP_LE, TraceTy::TRACE_BOOL, a, b);
+      case TokenType::GREATER:
+        return op(TraceOp::OP_GT, TraceTy::TRACE_BOOL, a, b);
+      case TokenType::GREATER_EQUAL:
+        return op(TraceOp::OP_GE, TraceTy::TRACE_BOOL, a, b);
+      case TokenType::EQUAL_EQUAL:
+        return op(TraceOp::OP_EQ, TraceTy::TRACE_BOOL, a, b);
+      case TokenType::BANG_EQUAL:
+        return op(TraceOp::OP_NE, TraceTy::TRACE_BOOL, a, b);
+      default:
+        throw NotTraceable{};
+    }
+  }
+
+  int expr(const Expr &expr) {
+    switch (expr.ty) {
+      case ExprTy::LITERAL: {
+        if (expr.lit.lit.ty != LiteralTy::LIT_NUMBER) {
+          throw NotTraceable{};
+        }
+        TraceIns k{TraceOp::OP_CONST, TraceTy::TRACE_NUM};
+        k.k = expr.lit.lit.number;
+        return emit(k);
+      }
+      case ExprTy::GROUPING:
+        return this->expr(*expr.group.expression);
+      case ExprTy::VAR_EXPR:
+        return read(expr.var_expr.name);
+      case ExprTy::ASSIGN_EXPR: {
+        int value = this->expr(*expr.ass_expr.value);
+        write(expr.ass_expr.name, value);
+        return value;
+      }
+      case ExprTy::UNARY:
+        if (expr.unary.op.type == TokenType::MINUS) {
+          return op(TraceOp::OP_NEG, TraceTy::TRACE_NUM, typed(*expr.unary.right, TraceTy::TRACE_NUM));
+        }
+        return op(TraceOp::OP_NOT, TraceTy::TRACE_BOOL, typed(*expr.unary.right, TraceTy::TRACE_BOOL));
+      case ExprTy::BINARY:
+        return binary(expr.bin);
+      case ExprTy::LOGICAL_EXPR: {
+        // Both sides are side-effect free, so on booleans there is no need
+        // to short-circuit (at worst a division guard exits spuriously)
+        int a = typed(*expr.logical.left, TraceTy::TRACE_BOOL);
+        int b = typed(*expr.logical.right, TraceTy::TRACE_BOOL);
+        return op(expr.logical.op.type == TokenType::OR ? TraceOp::OP_OR : TraceOp::OP_AND,
+                  TraceTy::TRACE_BOOL, a, b);
+      }
+      default:
+        throw NotTraceable{};
+    }
+  }
+
+  void stmt(const Stmt &stmt) {
+    switch (stmt.ty) {
+      case StmtTy::STMT_EXPR:
+        expr(stmt.expression.expr);
+        break;
+      case StmtTy::STMT_VAR: {
+        if (stmt.var.initializer.is_nil()) {
+          throw NotTraceable{};
+        }
+        int value = expr(stmt.var.initializer);
+        this->scopes.back()[stmt.var.name.lexeme] = value;
+        break;
+      }
+      case StmtTy::STMT_BLOCK:
+        this->scopes.emplace_back();
+        for (auto &st : stmt.block.statements) {
+          this->stmt(st);
+        }
+        this->scopes.pop_back();
+        break;
+      case StmtTy::STMT_IF: {
+        int cond = expr(stmt.if_stmt.condition);
+        if (this->next_branch >= this->branches.size() ||
+            this->branches[this->next_branch].first != &stmt.if_stmt) {
+          throw NotTraceable{};
+        }
+        bool taken = this->branches[this->next_branch++].second;
+        // Numbers are always truthy, no need for a guard
+        if (this->ins[cond].ty == TraceTy::TRACE_BOOL) {
+          guard(taken ? TraceOp::OP_GUARD_TRUE : TraceOp::OP_GUARD_FALSE, cond);
+        }
+        if (taken) {
+          this->stmt(*stmt.if_stmt.then_branch);
+        } else if (stmt.if_stmt.else_branch != nullptr) {
+          this->stmt(*stmt.if_stmt.else_branch);
+        }
+        break;
+      }
+      default:
+        throw NotTraceable{};
+    }
+  }
+
+public:
+  std::vector<TraceIns> ins;
+  std::vector<std::string> live_in;
+  std::vector<bool> stored;
+  int exits = 0;
+
+  TraceBuilder(Interpreter *interp, const std::vector<std::pair<const IfStmt *, bool>> &branches)
+      : interp(interp), branches(branches) {}
+
+  void build(const WhileStmt &loop) {
+    this->scopes.emplace_back();
+    int cond = expr(loop.cond);
+    if (this->ins[cond].ty == TraceTy::TRACE_BOOL) {
+      // Exit 0: the loop is over
+      TraceIns done{TraceOp::OP_GUARD_TRUE};
+      done.a = cond;
+      emit(done);
+    }
+    stmt(*loop.body);
+    if (this->next_branch != this->branches.size()) {
+      throw NotTraceable{};
+    }
+    for (size_t var = 0; var < this->live_in.size(); var++) {
+      if (this->stored[var]) {
+        TraceIns store{TraceOp::OP_STORE};
+        store.var = var;
+        store.a = this->current[var];
+        emit(store);
+      }
+    }
+  }
+};
+
+static double fold(TraceOp op, double a, double b) {
+  switch (op) {
+    case TraceOp::OP_NEG: return -a;
+    case TraceOp::OP_NOT: return a == 0;
+    case TraceOp::OP_ADD: return a + b;
+    case TraceOp::OP_SUB: return a - b;
+    case TraceOp::OP_MUL: return a * b;
+    case TraceOp::OP_DIV: return a / b;
+    case TraceOp::OP_LT: return a < b;
+    case TraceOp::OP_LE: return a <= b;
+    case TraceOp::OP_GT: return a > b;
+    case TraceOp::OP_GE: return a >= b;
+    case TraceOp::OP_EQ: return a == b;
+    case TraceOp::OP_NE: return a != b;
+    case TraceOp::OP_AND: return a != 0 && b != 0;
+    case TraceOp::OP_OR: return a != 0 || b != 0;
+    default: UNREACHABLE();
+  }
+}
+
+/* Constant folding, CSE and guard elimination in one forward pass, then
+ * dead code elimination. Returns, in "invariant", which instructions only
+ * depend on values that don't change from one iteration to the next */
+static void optimize(std::vector<TraceIns> &ins, const std::vector<bool> &stored,
+                     std::vector<bool> &invariant) {
+  std::vector<int> replace(ins.size());
+  std::map<std::tuple<int, int, int, int, uint64_t, int>, int> seen;
+  for (size_t i = 0; i < ins.size(); i++) {
+    auto &in = ins[i];
+    replace[i] = i;
+    if (in.a >= 0) {
+      in.a = replace[in.a];
+    }
+    if (in.b >= 0) {
+      in.b = replace[in.b];
+    }
+    bool const_a = in.a >= 0 && ins[in.a].op == TraceOp::OP_CONST;
+    bool const_b = in.b < 0 || ins[in.b].op == TraceOp::OP_CONST;
+    if (is_guard(in.op) && const_a) {
+      double v = ins[in.a].k;
+      bool passes = in.op == TraceOp::OP_GUARD_TRUE ? v != 0 : in.op == TraceOp::OP_GUARD_FALSE ? v == 0 : v != 0;
+      if (!passes) {
+        // Would exit on every iteration
+        throw NotTraceable{};
+      }
+      in.dead = true;
+      continue;
+    }
+    if (in.op != TraceOp::OP_CONST && in.op != TraceOp::OP_LOAD && in.op != TraceOp::OP_STORE &&
+        !is_guard(in.op) && const_a && const_b) {
+      in.k = fold(in.op, ins[in.a].k, in.b >= 0 ? ins[in.b].k : 0);
+      in.op = TraceOp::OP_CONST;
+      in.a = in.b = -1;
+    }
+    if (in.op == TraceOp::OP_STORE) {
+      continue;
+    }
+    uint64_t bits;
+    memcpy(&bits, &in.k, sizeof(bits));
+    // A boolean constant is loaded differently from the number with the same
+    // "k", so the type is part of what makes two instructions the same
+    auto key = std::make_tuple((int) in.op, (int) in.ty, in.a, in.b, bits, in.var);
+    auto found = seen.find(key);
+    if (found != seen.end()) {
+      replace[i] = found->second;
+      in.dead = true;
+    } else {
+      seen[key] = i;
+    }
+  }
+
+  invariant.assign(ins.size(), false);
+  for (size_t i = 0; i < ins.size(); i++) {
+    auto &in = ins[i];
+    switch (in.op) {
+      case TraceOp::OP_CONST:
+        invariant[i] = true;
+        break;
+      case TraceOp::OP_LOAD:
+        invariant[i] = !stored[in.var];
+        break;
+      case TraceOp::OP_STORE:
+        break;
+      default:
+        invariant[i] = (in.a < 0 || invariant[in.a]) && (in.b < 0 || invariant[in.b]);
+    }
+  }
+
+  std::vector<bool> live(ins.size(), false);
+  for (size_t i = ins.size(); i-- > 0;) {
+    auto &in = ins[i];
+    if (!in.dead && (in.op == TraceOp::OP_STORE || is_guard(in.op))) {
+      live[i] = true;
+    }
+    if (!live[i]) {
+      in.dead = true;
+      continue;
+    }
+    if (in.a >= 0) {
+      live[in.a] = true;
+    }
+    if (in.b >= 0) {
+      live[in.b] = true;
+    }
+  }
+}
+
+/* Compiles an optimized trace. The frame looks like this:
+ *   [rbp - 8]             saved rbx, which holds "vars"
+ *   [rbp - 16]            the "iterations" pointer
+ *   [rbp - 24 - 8 * i]    the value of instruction i */
+static std::vector<uint8_t> assemble(const std::vector<TraceIns> &ins,
+                                     const std::vector<bool> &invariant, int exits) {
+  X64Assembler as;
+  auto slot = [](int i) { return -24 - 8 * i; };
+  auto var = [](int v) { return 8 * v; };
+  std::vector<int> exit_labels;
+  for (int i = 0; i <= exits; i++) {
+    exit_labels.push_back(as.new_label());
+  }
+  int loop = as.new_label();
+  int epilogue = as.new_label();
+
+  as.push(X64Reg::RBP);
+  as.mov_rbp_rsp();
+  as.push(X64Reg::RBX);
+  size_t frame_size = as.sub_rsp(0);
+  as.mov(X64Reg::RBX, X64Reg::RDI);
+  as.store64(X64Reg::RBP, -16, X64Reg::RSI);
+
+  auto emit = [&](int i) {
+    auto &in = ins[i];
+    switch (in.op) {
+      case TraceOp::OP_CONST: {
+        uint64_t bits;
+        if (in.ty == TraceTy::TRACE_BOOL) {
+          bits = in.k != 0;
+        } else {
+          memcpy(&bits, &in.k, sizeof(bits));
+        }
+        as.mov_rax_imm64(bits);
+        as.store64(X64Reg::RBP, slot(i), X64Reg::RAX);
+        break;
+      }
+      case TraceOp::OP_LOAD:
+        as.movsd_load(X64Xmm::XMM0, X64Reg::RBX, var(in.var));
+        as.movsd_store(X64Reg::RBP, slot(i), X64Xmm::XMM0);
+        break;
+      case TraceOp::OP_STORE:
+        as.movsd_load(X64Xmm::XMM0, X64Reg::RBP, slot(in.a));
+        as.movsd_store(X64Reg::RBX, var(in.var), X64Xmm::XMM0);
+        break;
+      case TraceOp::OP_NEG:
+        as.movsd_load(X64Xmm::XMM0, X64Reg::RBP, slot(in.a));
+        as.mov_rax_imm64(0x8000000000000000ULL);
+        as.movq_xmm_rax(X64Xmm::XMM1);
+        as.xorpd(X64Xmm::XMM0, X64Xmm::XMM1);
+        as.movsd_store(X64Reg::RBP, slot(i), X64Xmm::XMM0);
+        break;
+      case TraceOp::OP_NOT:
+        as.load64(X64Reg::RAX, X64Reg::RBP, slot(in.a));
+        as.xor_eax_imm8(1);
+        as.store64(X64Reg::RBP, slot(i), X64Reg::RAX);
+        break;
+      case TraceOp::OP_AND:
+      case TraceOp::OP_OR:
+        as.load64(X64Reg::RAX, X64Reg::RBP, slot(in.a));
+        as.load64(X64Reg::RCX, X64Reg::RBP, slot(in.b));
+        if (in.op == TraceOp::OP_AND) {
+          as.and_eax_ecx();
+        } else {
+          as.or_eax_ecx();
+        }
+        as.store64(X64Reg::RBP, slot(i), X64Reg::RAX);
+        break;
+      case TraceOp::OP_GUARD_TRUE:
+      case TraceOp::OP_GUARD_FALSE:
+        as.load64(X64Reg::RAX, X64Reg::RBP, slot(in.a));
+        as.test_eax_eax();
+        as.jcc(in.op == TraceOp::OP_GUARD_TRUE ? X64Cond::COND_E : X64Cond::COND_NE,
+               exit_labels[in.exit]);
+        break;
+      case TraceOp::OP_GUARD_NONZERO: {
+        // -0.0 is zero too, NaN isn't
+        int ok = as.new_label();
+        as.movsd_load(X64Xmm::XMM1, X64Reg::RBP, slot(in.a));
+        as.xorpd(X64Xmm::XMM2, X64Xmm::XMM2);
+        as.ucomisd(X64Xmm::XMM1, X64Xmm::XMM2);
+        as.jcc(X64Cond::COND_P, ok);
+        as.jcc(X64Cond::COND_E, exit_labels[in.exit]);
+        as.bind(ok);
+        break;
+      }
+      default: {
+        as.movsd_load(X64Xmm::XMM0, X64Reg::RBP, slot(in.a));
+        as.movsd_load(X64Xmm::XMM1, X64Reg::RBP, slot(in.b));
+        bool boolean = true;
+        // Same NaN-correct conditions as the method JIT
+        switch (in.op) {
+          case TraceOp::OP_ADD: as.addsd(X64Xmm::XMM0, X64Xmm::XMM1); boolean = false; break;
+          case TraceOp::OP_SUB: as.subsd(X64Xmm::XMM0, X64Xmm::XMM1); boolean = false; break;
+          case TraceOp::OP_MUL: as.mulsd(X64Xmm::XMM0, X64Xmm::XMM1); boolean = false; break;
+          case TraceOp::OP_DIV: as.divsd(X64Xmm::XMM0, X64Xmm::XMM1); boolean = false; break;
+          case TraceOp::OP_GT:
+            as.ucomisd(X64Xmm::XMM0, X64Xmm::XMM1);
+            as.setcc_al(X64Cond::COND_A);
+            break;
+          case TraceOp::OP_GE:
+            as.ucomisd(X64Xmm::XMM0, X64Xmm::XMM1);
+            as.setcc_al(X64Cond::COND_AE);
+            break;
+          case TraceOp::OP_LT:
+            as.ucomisd(X64Xmm::XMM1, X64Xmm::XMM0);
+            as.setcc_al(X64Cond::COND_A);
+            break;
+          case TraceOp::OP_LE:
+            as.ucomisd(X64Xmm::XMM1, X64Xmm::XMM0);
+            as.setcc_al(X64Cond::COND_AE);
+            break;
+          case TraceOp::OP_EQ:
+            as.ucomisd(X64Xmm::XMM0, X64Xmm::XMM1);
+            as.setcc_al(X64Cond::COND_E);
+            as.setcc_cl(X64Cond::COND_NP);
+            as.and_al_cl();
+            break;
+          case TraceOp::OP_NE:
+            as.ucomisd(X64Xmm::XMM0, X64Xmm::XMM1);
+            as.setcc_al(X64Cond::COND_NE);
+            as.setcc_cl(X64Cond::COND_P);
+            as.or_al_cl();
+            break;
+          default:
+            UNREACHABLE();
+        }
+        if (boolean) {
+          as.movzx_eax_al();
+          as.store64(X64Reg::RBP, slot(i), X64Reg::RAX);
+        } else {
+          as.movsd_store(X64Reg::RBP, slot(i), X64Xmm::XMM0);
+        }
+      }
+    }
+  };
+
+  // Loop-invariant instructions run once, before the loop
+  for (size_t i = 0; i < ins.size(); i++) {
+    if (!ins[i].dead && invariant[i]) {
+      emit(i);
+    }
+  }
+  as.bind(loop);
+  for (size_t i = 0; i < ins.size(); i++) {
+    if (!ins[i].dead && !invariant[i]) {
+      emit(i);
+    }
+  }
+  as.load64(X64Reg::RAX, X64Reg::RBP, -16);
+  as.add_mem64_imm8(X64Reg::RAX, 0, 1);
+  as.jmp(loop);
+
+  for (int k = 0; k <= exits; k++) {
+    as.bind(exit_labels[k]);
+    as.mov_eax_imm(k);
+    as.jmp(epilogue);
+  }
+  as.bind(epilogue);
+  as.load64(X64Reg::RBX, X64Reg::RBP, -8);
+  as.leave();
+  as.ret();
+
+  // Keep rsp 16 byte aligned, even though traces never call anything
+  int32_t frame = 16 + 8 * ins.size();
+  frame = (frame + 15) / 16 * 16 + 8;
+  as.patch32(frame_size, frame);
+  return as.finish();
+}
+
+bool TraceJit::supported() { return Jit::supported(); }
+
+TraceLoop &TraceJit::loop_for(const WhileStmt *stmt) { return this->loops[stmt]; }
+
+void TraceJit::start_recording(TraceLoop &loop) {
+  this->active = &loop;
+  this->branches.clear();
+  loop.state = TraceState::TRACE_RECORDING;
+}
+
+void TraceJit::abort_recording(TraceLoop &loop) {
+  if (this->active == &loop) {
+    this->active = nullptr;
+  }
+  this->recordings_aborted++;
+  loop.back_edges = 0;
+  loop.state = ++loop.attempts >= TRACE_MAX_ATTEMPTS ? TraceState::TRACE_BLACKLISTED
+                                                      : TraceState::TRACE_COUNTING;
+}
+
+void TraceJit::compile(Interpreter *interp, TraceLoop &loop, const WhileStmt *stmt) {
+  this->active = nullptr;
+  auto trace = std::make_unique<Trace>();
+  std::vector<uint8_t> code;
+  try {
+    TraceBuilder builder(interp, this->branches);
+    builder.build(*stmt);
+    std::vector<bool> invariant;
+    optimize(builder.ins, builder.stored, invariant);
+    code = assemble(builder.ins, invariant, builder.exits);
+    trace->live_in = std::move(builder.live_in);
+    trace->stored = std::move(builder.stored);
+  } catch (NotTraceable &) {
+    abort_recording(loop);
+    return;
+  }
+  std::string name = "trace" + std::to_string(this->traces_compiled);
+  trace->code = (TraceCode) this->code_heap.install(code, name);
+  if (trace->code == nullptr) {
+    abort_recording(loop);
+    return;
+  }
+  trace->vars.resize(trace->live_in.size());
+  trace->elements.resize(trace->live_in.size());
+  loop.trace = std::move(trace);
+  loop.state = TraceState::TRACE_COMPILED;
+  this->traces_compiled++;
+}
+
+void TraceJit::retrace_if_unprofitable(TraceLoop &loop) {
+  if (loop.side_exits < TRACE_MIN_EXITS ||
+      loop.iterations >= loop.side_exits * TRACE_MIN_ITERATIONS_PER_EXIT) {
+    return;
+  }
+  // The hot path probably changed, record it again (the code of the old
+  // trace stays mapped until we're done, it's not worth unmapping)
+  loop.trace = nullptr;
+  loop.side_exits = 0;
+  loop.iterations = 0;
+  loop.back_edges = 0;
+  loop.state = ++loop.attempts >= TRACE_MAX_ATTEMPTS ? TraceState::TRACE_BLACKLISTED
+                                                      : TraceState::TRACE_COUNTING;
+}
+
+bool TraceJit::enter(Interpreter *interp, TraceLoop &loop) {
+  Trace &trace = *loop.trace;
+  // The type guards of every variable the trace touches, hoisted out of it
+  for (size_t i = 0; i < trace.live_in.size(); i++) {
+    LoxElement *element = interp->globals.find(trace.live_in[i]);
+    if (element == nullptr) {
+      element = interp->locals.find(trace.live_in[i]);
+    }
+    if (element == nullptr || !element->is_number()) {
+      this->guard_failures++;
+      loop.side_exits++;
+      retrace_if_unprofitable(loop);
+      return false;
+    }
+    trace.elements[i] = element;
+    trace.vars[i] = element->lox_number();
+  }
+
+  long iterations = 0;
+  auto start = std::chrono::steady_clock::now();
+  int exit = trace.code(trace.vars.data(), &iterations);
+  auto end = std::chrono::steady_clock::now();
+  this->native_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+  for (size_t i = 0; i < trace.live_in.size(); i++) {
+    if (trace.stored[i]) {
+      *trace.elements[i] = LoxElement(trace.vars[i]);
+    }
+  }
+  this->entries++;
+  this->iterations += iterations;
+  loop.entries++;
+  loop.iterations += iterations;
+  if (exit == 0) {
+    return true;
+  }
+  this->side_exits++;
+  loop.side_exits++;
+  retrace_if_unprofitable(loop);
+  return false;
+}
+
+bool TraceJit::back_edge(Interpreter *interp, TraceLoop &loop, const WhileStmt *stmt) {
+  switch (loop.state) {
+    case TraceState::TRACE_COUNTING:
+      if (++loop.back_edges >= TRACE_HOT_LOOP && this->active == nullptr) {
+        start_recording(loop);
+      }
+      return false;
+    case TraceState::TRACE_RECORDING:
+      compile(interp, loop, stmt);
+      return loop.state == TraceState::TRACE_COMPILED && enter(interp, loop);
+    case TraceState::TRACE_COMPILED:
+      return enter(interp, loop);
+    default:
+      return false;
+  }
+}
+
+void TraceJit::loop_exited(TraceLoop &loop) {
+  if (this->active == &loop) {
+    abort_recording(loop);
+  }
+}
+
+void TraceJit::record_branch(const IfStmt *if_stmt, bool taken) {
+  this->branches.push_back({if_stmt, taken});
+}
+
+void TraceJit::report(std::ostream &out) const {
+  out << "trace-jit: " << this->traces_compiled << " traces compiled, "
+      << this->recordings_aborted << " recordings aborted" << std::endl;
+  out << "trace-jit: " << this->entries << " trace entries, " << this->iterations
+      << " iterations in compiled code" << std::endl;
+  out << "trace-jit: " << this->side_exits << " side exits taken, "
+      << this->guard_failures << " entry type guard failures" << std::endl;
+  out << "trace-jit: " << this->native_ns / 1000000.0 << " ms in compiled code" << std::endl;
+}
@@ -0,0 +1,112 @@
+#ifndef TRACE_JIT_H_
+#define TRACE_JIT_H_
+
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "jit.hpp"
+#include "../LexParse/stmt.hpp"
+
+class Interpreter;
+class LoxElement;
+
+/* A tracing JIT for hot loops of the tree-walking engine (Linux x86-64 only,
+ * sharing the assembler and executable memory of the method JIT).
+ *
+ * Interpreter::run_while_stmt counts the back-edges of every loop. Once a
+ * loop is hot we record its next iteration: which way every "if" went. The
+ * recorded path is turned into a linear trace (an SSA-like list of numeric
+ * operations with a guard wherever the path could have gone differently or
+ * the interpreter would raise a division by zero), optimized and compiled:
+ *   - type guards: every variable from outside the loop must be a number, and
+ *     the trace only ever stores numbers into them, so they're checked once
+ *     when the trace is entered instead of at every read,
+ *   - unboxing: those variables live as raw doubles while the trace runs and
+ *     are only written back into their LoxElements when it exits,
+ *   - constant folding, CSE (duplicate guards included) and dead code
+ *     elimination,
+ *   - loop-invariant code motion: anything depending only on constants and
+ *     variables the loop never writes is computed (or guarded) once, before
+ *     the loop.
+ *
+ * Only side-effect free iterations are traced (no printing, calls, nested
+ * loops or returns), and a trace only commits its stores at the end of each
+ * iteration. So a side exit is trivial: the variables hold exactly what they
+ * held at the start of the failing iteration, and the tree walker resumes at
+ * the loop header, re-running that iteration (and producing any runtime error
+ * itself). */
+
+// Native code of a trace: "vars" holds the unboxed variables it reads or
+// writes, "*iterations" is incremented for every completed iteration.
+// Returns 0 once the loop condition is false, otherwise the side exit taken
+typedef int (*TraceCode)(double *vars, long *iterations);
+
+enum TraceState { TRACE_COUNTING, TRACE_RECORDING, TRACE_COMPILED, TRACE_BLACKLISTED };
+
+class Trace {
+public:
+  TraceCode code = nullptr;
+  // Variables from outside the loop, by name, and whether the trace stores
+  // into them
+  std::vector<std::string> live_in;
+  std::vector<bool> stored;
+  // Scratch space for entering the trace: the unboxed values and where they
+  // were read from
+  std::vector<double> vars;
+  std::vector<LoxElement *> elements;
+};
+
+// What we know about one while loop (for loops included, they're desugared)
+class TraceLoop {
+public:
+  long back_edges = 0;
+  int attempts = 0;
+  long entries = 0;
+  long side_exits = 0;
+  long iterations = 0;
+  TraceState state = TraceState::TRACE_COUNTING;
+  std::unique_ptr<Trace> trace;
+};
+
+class TraceJit {
+private:
+  std::unordered_map<const WhileStmt *, TraceLoop> loops;
+  CodeHeap code_heap;
+  // The loop whose iteration is being recorded, and the branches taken so far
+  TraceLoop *active = nullptr;
+  std::vector<std::pair<const IfStmt *, bool>> branches;
+
+  long traces_compiled = 0;
+  long recordings_aborted = 0;
+  long entries = 0;
+  long guard_failures = 0;
+  long side_exits = 0;
+  long iterations = 0;
+  long long native_ns = 0;
+
+  void start_recording(TraceLoop &loop);
+  void abort_recording(TraceLoop &loop);
+  void compile(Interpreter *interp, TraceLoop &loop, const WhileStmt *stmt);
+  bool enter(Interpreter *interp, TraceLoop &loop);
+  void retrace_if_unprofitable(TraceLoop &loop);
+
+public:
+  static bool supported();
+
+  TraceLoop &loop_for(const WhileStmt *stmt);
+  // Called after every iteration the interpreter runs. Returns true if the
+  // loop was then run to completion by its trace
+  bool back_edge(Interpreter *interp, TraceLoop &loop, const WhileStmt *stmt);
+  // Called whenever the interpreter leaves the loop, however it does it
+  void loop_exited(TraceLoop &loop);
+  bool recording() const { return this->active != nullptr; }
+  void record_branch(const IfStmt *if_stmt, bool taken);
+  // --trace-jit-stats
+  void report(std::ostream &out) const;
+};
+
+#endif // TRACE_JIT_H_
@@ -0,0 +1,189 @@
+#include "x64_assembler.hpp"
+
+#include <cstring>
+
+#include "../util.hpp"
+
+void X64Assembler::byte(uint8_t b) { this->code.push_back(b); }
+
+void X64Assembler::imm32(int32_t v) {
+  uint8_t bytes[4];
+  memcpy(bytes, &v, sizeof(bytes));
+  this->code.insert(this->code.end(), bytes, bytes + 4);
+}
+
+void X64Assembler::imm64(uint64_t v) {
+  uint8_t bytes[8];
+  memcpy(bytes, &v, sizeof(bytes));
+  this->code.insert(this->code.end(), bytes, bytes + 8);
+}
+
+void X64Assembler::mem(int reg, X64Reg base, int32_t disp) {
+  ASSERT_COND(base != X64Reg::RSP, "X64Assembler: rsp-relative addressing needs a SIB byte");
+  // mod = 10 (disp32), reg, rm = base
+  byte(0x80 | ((reg & 7) << 3) | (base & 7));
+  imm32(disp);
+}
+
+void X64Assembler::rel32_to(int label) {
+  this->fixups.push_back(Fixup{this->code.size(), label});
+  imm32(0);
+}
+
+int X64Assembler::new_label() {
+  this->labels.push_back(-1);
+  return this->labels.size() - 1;
+}
+
+void X64Assembler::bind(int label) { this->labels[label] = this->code.size(); }
+
+size_t X64Assembler::size() const { return this->code.size(); }
+
+void X64Assembler::push(X64Reg r) { byte(0x50 + r); }
+
+void X64Assembler::pop(X64Reg r) { byte(0x58 + r); }
+
+void X64Assembler::mov_rbp_rsp() {
+  byte(0x48); byte(0x89); byte(0xE5);
+}
+
+size_t X64Assembler::sub_rsp(int32_t imm) {
+  byte(0x48); byte(0x81); byte(0xEC);
+  size_t at = this->code.size();
+  imm32(imm);
+  return at;
+}
+
+void X64Assembler::patch32(size_t at, int32_t v) {
+  memcpy(&this->code[at], &v, sizeof(v));
+}
+
+void X64Assembler::leave() { byte(0xC9); }
+
+void X64Assembler::ret() { byte(0xC3); }
+
+void X64Assembler::mov(X64Reg dst, X64Reg src) {
+  byte(0x48); byte(0x89); byte(0xC0 | (src << 3) | dst);
+}
+
+void X64Assembler::mov_eax_imm(int32_t imm) {
+  byte(0xB8);
+  imm32(imm);
+}
+
+void X64Assembler::xor_eax_eax() { byte(0x31); byte(0xC0); }
+
+void X64Assembler::xor_eax_imm8(int8_t imm) {
+  byte(0x83); byte(0xF0); byte(imm);
+}
+
+void X64Assembler::test_eax_eax() { byte(0x85); byte(0xC0); }
+
+void X64Assembler::mov_rax_imm64(uint64_t imm) {
+  byte(0x48); byte(0xB8);
+  imm64(imm);
+}
+
+void X64Assembler::store64(X64Reg base, int32_t disp, X64Reg src) {
+  byte(0x48); byte(0x89);
+  mem(src, base, disp);
+}
+
+void X64Assembler::load64(X64Reg dst, X64Reg base, int32_t disp) {
+  byte(0x48); byte(0x8B);
+  mem(dst, base, disp);
+}
+
+void X64Assembler::lea(X64Reg dst, X64Reg base, int32_t disp) {
+  byte(0x48); byte(0x8D);
+  mem(dst, base, disp);
+}
+
+void X64Assembler::add_mem64_imm8(X64Reg base, int32_t disp, int8_t imm) {
+  byte(0x48); byte(0x83);
+  mem(0, base, disp);
+  byte(imm);
+}
+
+void X64Assembler::and_eax_ecx() { byte(0x21); byte(0xC8); }
+
+void X64Assembler::or_eax_ecx() { byte(0x09); byte(0xC8); }
+
+void X64Assembler::movsd_load(X64Xmm dst, X64Reg base, int32_t disp) {
+  byte(0xF2); byte(0x0F); byte(0x10);
+  mem(dst, base, disp);
+}
+
+void X64Assembler::movsd_store(X64Reg base, int32_t disp, X64Xmm src) {
+  byte(0xF2); byte(0x0F); byte(0x11);
+  mem(src, base, disp);
+}
+
+void X64Assembler::movq_xmm_rax(X64Xmm dst) {
+  byte(0x66); byte(0x48); byte(0x0F); byte(0x6E);
+  byte(0xC0 | (dst << 3));
+}
+
+// All the register-register SSE2 instructions we need share this shape
+static void sse_rr(std::vector<uint8_t> &code, uint8_t prefix, uint8_t op, X64Xmm dst, X64Xmm src) {
+  code.push_back(prefix);
+  code.push_back(0x0F);
+  code.push_back(op);
+  code.push_back(0xC0 | (dst << 3) | src);
+}
+
+void X64Assembler::movapd(X64Xmm dst, X64Xmm src) { sse_rr(this->code, 0x66, 0x28, dst, src); }
+
+void X64Assembler::addsd(X64Xmm dst, X64Xmm src) { sse_rr(this->code, 0xF2, 0x58, dst, src); }
+
+void X64Assembler::subsd(X64Xmm dst, X64Xmm src) { sse_rr(this->code, 0xF2, 0x5C, dst, src); }
+
+void X64Assembler::mulsd(X64Xmm dst, X64Xmm src) { sse_rr(this->code, 0xF2, 0x59, dst, src); }
+
+void X64Assembler::divsd(X64Xmm dst, X64Xmm src) { sse_rr(this->code, 0xF2, 0x5E, dst, src); }
+
+void X64Assembler::xorpd(X64Xmm dst, X64Xmm src) { sse_rr(this->code, 0x66, 0x57, dst, src); }
+
+void X64Assembler::ucomisd(X64Xmm a, X64Xmm b) { sse_rr(this->code, 0x66, 0x2E, a, b); }
+
+void X64Assembler::setcc_al(X64Cond cond) {
+  byte(0x0F); byte(0x90 | cond); byte(0xC0);
+}
+
+void X64Assembler::setcc_cl(X64Cond cond) {
+  byte(0x0F); byte(0x90 | cond); byte(0xC1);
+}
+
+void X64Assembler::and_al_cl() { byte(0x20); byte(0xC8); }
+
+void X64Assembler::or_al_cl() { byte(0x08); byte(0xC8); }
+
+void X64Assembler::movzx_eax_al() { byte(0x0F); byte(0xB6); byte(0xC0); }
+
+void X64Assembler::jmp(int label) {
+  byte(0xE9);
+  rel32_to(label);
+}
+
+void X64Assembler::jcc(X64Cond cond, int label) {
+  byte(0x0F); byte(0x80 | cond);
+  rel32_to(label);
+}
+
+void X64Assembler::call(int label) {
+  byte(0xE8);
+  rel32_to(label);
+}
+
+std::vector<uint8_t> X64Assembler::finish() {
+  for (auto &fix : this->fixups) {
+    long target = this->labels[fix.label];
+    ASSERT_COND(target >= 0, "X64Assembler: jump to an unbound label");
+    // rel32 is relative to the end of the instruction, which is where the
+    // 4 bytes of displacement end
+    int32_t rel = (int32_t) (target - (long) (fix.at + 4));
+    memcpy(&this->code[fix.at], &rel, sizeof(rel));
+  }
+  this->fixups.clear();
+  return std::move(this->code);
+}
@@ -0,0 +1,97 @@
+#ifndef X64_ASSEMBLER_H_
+#define X64_ASSEMBLER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* A tiny x86-64 assembler, just big enough for the template JITs.
+ * It only knows the handful of instructions they emit: scalar double
+ * arithmetic on xmm0-xmm2, loads and stores relative to a base register
+ * (disp32, never rsp/r12 so we don't need a SIB byte), compares, setcc and
+ * rel32 jumps/calls to labels. Everything it produces is position independent,
+ * so the buffer can be copied anywhere once finished. */
+
+enum X64Reg { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7 };
+enum X64Xmm { XMM0 = 0, XMM1 = 1, XMM2 = 2 };
+
+// Condition codes, as encoded in the low nibble of jcc/setcc
+enum X64Cond {
+  COND_P = 0xA, COND_NP = 0xB, COND_E = 0x4, COND_NE = 0x5,
+  COND_A = 0x7, COND_AE = 0x3, COND_B = 0x2, COND_BE = 0x6
+};
+
+class X64Assembler {
+private:
+  struct Fixup {
+    size_t at;   // where the rel32 lives
+    int label;
+  };
+  std::vector<uint8_t> code;
+  std::vector<long> labels; // bound offset of each label, -1 if unbound
+  std::vector<Fixup> fixups;
+
+  void byte(uint8_t b);
+  void imm32(int32_t v);
+  void imm64(uint64_t v);
+  // modrm for "reg, [base + disp32]"
+  void mem(int reg, X64Reg base, int32_t disp);
+  void rel32_to(int label);
+
+public:
+  int new_label();
+  void bind(int label);
+  size_t size() const;
+
+  void push(X64Reg r);
+  void pop(X64Reg r);
+  void mov_rbp_rsp();
+  // Returns where the immediate lives, so it can be patched once the frame
+  // size is known
+  size_t sub_rsp(int32_t imm);
+  void patch32(size_t at, int32_t v);
+  void leave();
+  void ret();
+
+  // 64 bit register to register move
+  void mov(X64Reg dst, X64Reg src);
+  void mov_eax_imm(int32_t imm);
+  void xor_eax_eax();
+  void xor_eax_imm8(int8_t imm);
+  void test_eax_eax();
+  void mov_rax_imm64(uint64_t imm);
+  void store64(X64Reg base, int32_t disp, X64Reg src);
+  void load64(X64Reg dst, X64Reg base, int32_t disp);
+  void lea(X64Reg dst, X64Reg base, int32_t disp);
+  void add_mem64_imm8(X64Reg base, int32_t disp, int8_t imm);
+  void and_eax_ecx();
+  void or_eax_ecx();
+
+  void movsd_load(X64Xmm dst, X64Reg base, int32_t disp);
+  void movsd_store(X64Reg base, int32_t disp, X64Xmm src);
+  void movq_xmm_rax(X64Xmm dst);
+  void movapd(X64Xmm dst, X64Xmm src);
+  void addsd(X64Xmm dst, X64Xmm src);
+  void subsd(X64Xmm dst, X64Xmm src);
+  void mulsd(X64Xmm dst, X64Xmm src);
+  void divsd(X64Xmm dst, X64Xmm src);
+  void xorpd(X64Xmm dst, X64Xmm src);
+  void ucomisd(X64Xmm a, X64Xmm b);
+
+  // setcc into al (or cl), zero-extending the final result into eax is left
+  // to movzx_eax_al
+  void setcc_al(X64Cond cond);
+  void setcc_cl(X64Cond cond);
+  void and_al_cl();
+  void or_al_cl();
+  void movzx_eax_al();
+
+  void jmp(int label);
+  void jcc(X64Cond cond, int label);
+  void call(int label);
+
+  // Resolves all jumps and returns the machine code
+  std::vector<uint8_t> finish();
+};
+
+#endif // X64_ASSEMBLER_H_
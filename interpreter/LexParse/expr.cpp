@@ -7,7 +7,7 @@
 #include "expr.hpp"
 #include "tokens.hpp"
 
-BinaryExpr::BinaryExpr(BinaryExpr &&to_move) : op(std::move(to_move.op)) {
+BinaryExpr::BinaryExpr(BinaryExpr &&to_move) : op(std::move(to_move.op)), spec(to_move.spec) {
   this->left = to_move.left;
   to_move.left = nullptr;
   this->right = to_move.right;
@@ -18,7 +18,7 @@ BinaryExpr &BinaryExpr::operator=(BinaryExpr &&to_move) {
   this->left = to_move.left;
   this->right = to_move.right;
   this->op = std::move(to_move.op);
-
+  this->spec = to_move.spec;
 
   to_move.left = nullptr;
   to_move.right = nullptr;
@@ -34,10 +34,26 @@ std::string BinaryExpr::parenthesize() const {
   return Expr::parenthesize(this->op.lexeme, 2, this->left, this->right);
 }
 
-BinaryExpr::~BinaryExpr() {
-  if (this->left != nullptr) {
-    delete this->left;
+// The parser builds chains of binary and logical operators (a + b + c ...)
+// left-deep, and generated code can make them arbitrarily long. So the left
+// spine is freed in a loop, only the (shallow) right sides recurse
+static void delete_left_spine(Expr *expr) {
+  while (expr != nullptr) {
+    Expr *next = nullptr;
+    if (expr->ty == ExprTy::BINARY) {
+      next = expr->bin.left;
+      expr->bin.left = nullptr;
+    } else if (expr->ty == ExprTy::LOGICAL_EXPR) {
+      next = expr->logical.left;
+      expr->logical.left = nullptr;
+    }
+    delete expr;
+    expr = next;
   }
+}
+
+BinaryExpr::~BinaryExpr() {
+  delete_left_spine(this->left);
   if (this->right != nullptr) {
     delete this->right;
   }
@@ -68,10 +84,11 @@ GroupingExpr::~GroupingExpr() {
 
 LiteralExpr::LiteralExpr(Literal lit) : lit(std::move(lit)) {}
 
-LiteralExpr::LiteralExpr(LiteralExpr &&to_move) : lit(std::move(to_move.lit)) {}
+LiteralExpr::LiteralExpr(LiteralExpr &&to_move) : lit(std::move(to_move.lit)), interned(to_move.interned) {}
 
 LiteralExpr &LiteralExpr::operator=(LiteralExpr &&to_move) {
   this->lit = std::move(to_move.lit);
+  this->interned = to_move.interned;
   return *this;
 }
 
@@ -147,10 +164,7 @@ LogicalExpr::LogicalExpr(LogicalExpr &&to_move): op(std::move(to_move.op)) {
 }
 
 LogicalExpr::~LogicalExpr() {
-  if (this->left != nullptr) {
-    delete this->left;
-
-  }
+  delete_left_spine(this->left);
   if (this->right != nullptr) {
     delete this->right;
   }
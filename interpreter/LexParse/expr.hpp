@@ -9,12 +9,27 @@
 #include "../util.hpp"
 
 class Expr;
+class LoxString;
+
+/* What a BinaryExpr has specialized itself to in the tree-walking
+ * interpreter. Nodes start out uninitialized, rewrite themselves to the
+ * specialization matching the operand types of their first evaluation (or to
+ * generic if there's none), and fall back to generic for good as soon as
+ * those types change. See Interpreter::evaluate_binary_expr */
+enum BinarySpec {
+    SPEC_UNINITIALIZED, SPEC_GENERIC,
+    SPEC_NUM_ADD, SPEC_NUM_SUB, SPEC_NUM_MUL, SPEC_NUM_DIV,
+    SPEC_NUM_GREATER, SPEC_NUM_GREATER_EQUAL, SPEC_NUM_LESS, SPEC_NUM_LESS_EQUAL,
+    SPEC_NUM_EQUAL, SPEC_NUM_NOT_EQUAL, SPEC_STR_CONCAT,
+    SPEC_COUNT
+};
 
 class BinaryExpr {
   public:
     Expr* left;
     Token op/*erator*/;
     Expr* right;
+    mutable BinarySpec spec = BinarySpec::SPEC_UNINITIALIZED;
     std::string parenthesize() const;
     BinaryExpr(Expr *left, Token op, Expr *right);
     BinaryExpr(BinaryExpr &&to_move);
@@ -35,6 +50,9 @@ class GroupingExpr {
 class LiteralExpr {
   public:
     Literal lit;
+    // For a string literal, the interned string the interpreter made (and
+    // holds a reference to) before running the program
+    mutable LoxString *interned = nullptr;
     std::string parenthesize() const;
     LiteralExpr(Literal lit);
     LiteralExpr(LiteralExpr &&to_move);
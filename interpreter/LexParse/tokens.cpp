@@ -55,6 +55,9 @@ Literal::Literal(const Literal &other) {
         case LiteralTy::LIT_STRING:
             init_union_field(this->str, std::string, other.str);
             break;
+        case LiteralTy::LIT_BOOL:
+            this->lox_bool = other.lox_bool;
+            break;
         case LiteralTy::LIT_NIL:
             this->nil = LiteralTy::LIT_NIL;
             break;
@@ -79,6 +82,7 @@ Literal &Literal::operator=(Literal &&to_move) {
             std::destroy_at(&this->str);
             break;
         case LiteralTy::LIT_NUMBER:
+        case LiteralTy::LIT_BOOL:
         case LiteralTy::LIT_NIL:
             break;
 
@@ -92,6 +96,9 @@ Literal &Literal::operator=(Literal &&to_move) {
         case LiteralTy::LIT_NUMBER:
             this->number = to_move.number;
             break;
+        case LiteralTy::LIT_BOOL:
+            this->lox_bool = to_move.lox_bool;
+            break;
         case LiteralTy::LIT_NIL:
             this->nil = LiteralTy::LIT_NIL;
             break;
@@ -112,6 +119,9 @@ Literal::Literal(Literal &&to_move) {
         case LiteralTy::LIT_NUMBER:
             this->number = to_move.number;
             break;
+        case LiteralTy::LIT_BOOL:
+            this->lox_bool = to_move.lox_bool;
+            break;
         case LiteralTy::LIT_STRING:
             // Carefully construct str properly, without reading uninited memory
             // (because we are using a union)
@@ -1,69 +1,417 @@
+#include <cerrno>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Interpreter/alloc_counter.hpp"
+#include "Interpreter/batch.hpp"
+#include "Interpreter/c_emitter.hpp"
 #include "Interpreter/interpreter.hpp"
+#include "Interpreter/jit.hpp"
+#include "Interpreter/snapshot.hpp"
+#include "Interpreter/trace_jit.hpp"
 #include "LexParse/scanner.hpp"
 #include "LexParse/tokens.hpp"
 #include "LexParse/expr.hpp"
 #include "LexParse/parser.hpp"
 #include "util.hpp"
 #include "lox.hpp"
+#include "main.hpp"
 
 #define WRONG_USAGE (64)
 
 
-static void print_usage() { printf("Usage: jlox [script]\n"); }
+static void print_usage() {
+  printf("Usage: jlox [--engine=tree|closure] [--no-jit] [--jit-threshold=N] "
+         "[--perf-map] [--trace-jit-stats] [--spec-stats] [--stack-eval] [--max-depth=N] [--intern-max=N] "
+         "[--count-allocs] [--gc-stats] [--region] "
+         "[--emit-c out.c] [--snapshot-out IMG | --snapshot-in IMG] [--serve SOCK] "
+         "[--batch=NAME --batch-input=FILE] [script]\n");
+}
+
+// Parses the command line into "opts", returning false if it makes no sense
+static bool parse_args(int argc, char **argv, RunOptions &opts) {
+  bool max_depth = false;
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    if (strcmp(arg, "--engine=tree") == 0) {
+      opts.engine = Engine::ENGINE_TREE;
+    } else if (strcmp(arg, "--engine=closure") == 0) {
+      opts.engine = Engine::ENGINE_CLOSURE;
+    } else if (strcmp(arg, "--no-jit") == 0) {
+      opts.jit = false;
+    } else if (strncmp(arg, "--jit-threshold=", 16) == 0) {
+      opts.jit_threshold = atol(arg + 16);
+    } else if (strcmp(arg, "--perf-map") == 0) {
+      opts.perf_map = true;
+    } else if (strcmp(arg, "--emit-c") == 0) {
+      if (i + 1 >= argc) {
+        return false;
+      }
+      opts.emit_c = argv[++i];
+    } else if (strcmp(arg, "--snapshot-out") == 0) {
+      if (i + 1 >= argc) {
+        return false;
+      }
+      opts.snapshot_out = argv[++i];
+    } else if (strcmp(arg, "--snapshot-in") == 0) {
+      if (i + 1 >= argc) {
+        return false;
+      }
+      opts.snapshot_in = argv[++i];
+    } else if (strcmp(arg, "--serve") == 0) {
+      if (i + 1 >= argc) {
+        return false;
+      }
+      opts.serve = argv[++i];
+    } else if (strcmp(arg, "--trace-jit-stats") == 0) {
+      opts.trace_jit_stats = true;
+    } else if (strcmp(arg, "--spec-stats") == 0) {
+      opts.spec_stats = true;
+    } else if (strcmp(arg, "--stack-eval") == 0) {
+      opts.stack_eval = true;
+    } else if (strncmp(arg, "--max-depth=", 12) == 0) {
+      opts.max_depth = atol(arg + 12);
+      max_depth = true;
+    } else if (strncmp(arg, "--intern-max=", 13) == 0) {
+      opts.intern_max = atol(arg + 13);
+    } else if (strcmp(arg, "--count-allocs") == 0) {
+      opts.count_allocs = true;
+    } else if (strcmp(arg, "--gc-stats") == 0) {
+      opts.gc_stats = true;
+    } else if (strcmp(arg, "--region") == 0) {
+      opts.region = true;
+    } else if (strncmp(arg, "--batch=", 8) == 0) {
+      opts.batch_fn = arg + 8;
+    } else if (strncmp(arg, "--batch-input=", 14) == 0) {
+      opts.batch_input = arg + 14;
+    } else if (strncmp(arg, "--", 2) == 0 || opts.script != nullptr) {
+      return false;
+    } else {
+      opts.script = arg;
+    }
+  }
+  // An image only holds what its own prelude defined
+  if (opts.snapshot_out != nullptr && opts.snapshot_in != nullptr) {
+    return false;
+  }
+  // The closure engine has no explicit stack, it always recurses
+  if (opts.engine == Engine::ENGINE_CLOSURE && (opts.stack_eval || max_depth)) {
+    return false;
+  }
+  return (opts.batch_fn == nullptr) == (opts.batch_input == nullptr);
+}
 
 static void run_prompt() {
   // TODO: uninteresting for now
 }
 
-static void run(char *content, long content_len) {
-  auto sc = Scanner(content, content_len);
-  auto tokens = sc.scan_tokens();
-  auto parser = Parser(std::move(tokens));
-  auto prog = parser.parse();
-  auto interp = Interpreter{};
-  interp.interpret(prog);
-  free(content);
+static void emit_c(const std::vector<Stmt> &prog, const char *out_path) {
+  CEmitter emitter;
+  std::string code = emitter.emit(prog);
+  FILE *out = fopen(out_path, "w");
+  if (!out) {
+    printf("Could not open %s\n", out_path);
+    exit(EXIT_FAILURE);
+  }
+  if (fwrite(code.data(), 1, code.size(), out) != code.size() || fclose(out) != 0) {
+    printf("Something went wrong with writing %s\n", out_path);
+    exit(EXIT_FAILURE);
+  }
 }
 
-static void run_file(const char *file) {
+// Reads a CSV file of numbers into columns. Blank lines and a first line
+// that doesn't start with a number (a header) are skipped
+static std::vector<std::vector<double>> read_columns(const char *path) {
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    printf("Could not open %s\n", path);
+    exit(WRONG_USAGE);
+  }
+  std::vector<std::vector<double>> columns;
+  char *line = nullptr;
+  size_t cap = 0;
+  long line_no = 0;
+  size_t rows = 0;
+  while (getline(&line, &cap, in) != -1) {
+    line_no++;
+    char *cur = line;
+    while (*cur == ' ' || *cur == '\t') {
+      cur++;
+    }
+    if (*cur == '\n' || *cur == '\r' || *cur == '\0') {
+      continue;
+    }
+    size_t col = 0;
+    while (true) {
+      char *end;
+      double value = strtod(cur, &end);
+      if (end == cur) {
+        if (line_no == 1 && col == 0) {
+          break;
+        }
+        printf("%s:%ld: expected a number\n", path, line_no);
+        exit(EXIT_FAILURE);
+      }
+      if (columns.size() <= col) {
+        // The first row decides how many columns there are
+        if (rows > 0) {
+          printf("%s:%ld: expected %zu fields\n", path, line_no, columns.size());
+          exit(EXIT_FAILURE);
+        }
+        columns.emplace_back();
+      }
+      columns[col++].push_back(value);
+      cur = end;
+      while (*cur == ' ' || *cur == '\t') {
+        cur++;
+      }
+      if (*cur != ',') {
+        break;
+      }
+      cur++;
+    }
+    if (col == 0) {
+      continue;
+    }
+    if (col != columns.size()) {
+      printf("%s:%ld: expected %zu fields\n", path, line_no, columns.size());
+      exit(EXIT_FAILURE);
+    }
+    rows++;
+  }
+  free(line);
+  fclose(in);
+  return columns;
+}
+
+static void run_batch(Interpreter &interp, const RunOptions &opts) {
+  auto columns = read_columns(opts.batch_input);
+  Token where(TokenType::IDENTIFIER, opts.batch_fn, None, 0);
+  LoxElement *fn = interp.locals.find(opts.batch_fn);
+  if (fn == nullptr) {
+    std::cout << LoxRuntimeErr(where.clone(), "Undefined function.").diagnostic() << std::endl;
+    return;
+  }
+  // Copied out of the environment, which calls may modify
+  LoxElement callee = fn->copy();
+  BatchExecutor batch{&interp};
+  try {
+    batch.run(where, callee, columns, [](size_t, LoxElement result) {
+      std::cout << result.stringify() << '\n';
+    });
+  } catch (LoxRuntimeErr &ler) {
+    std::cout << ler.diagnostic() << std::endl;
+  }
+  std::cout.flush();
+}
+
+// Reads a whole file into a malloc'd buffer. If we can't, says why and
+// returns nullptr, with the code to exit with in "status"
+static char *read_file(const char *file, long &len, int &status) {
   FILE *prog = fopen(file, "r");
   if (!prog) {
     printf("Could not open %s\n", file);
-    exit(WRONG_USAGE);
+    status = WRONG_USAGE;
+    return nullptr;
   }
 
   fseek(prog, 0, SEEK_END);
-  long len = ftell(prog);
+  len = ftell(prog);
   rewind(prog);
   char *content = (char *) malloc(sizeof(char) * len);
   ASSERT_ALLOC(content);
   size_t read = fread(content, len, 1, prog);
+  fclose(prog);
 
   if (read == 0) {
     printf("Something went wrong with reading the file. Exiting\n");
     free(content);
-    exit(EXIT_FAILURE);
+    status = EXIT_FAILURE;
+    return nullptr;
   }
+  return content;
+}
 
-  fclose(prog);
-  run(content, len);
+// Runs one request of serve in a child of the server, with the connection
+// as its stdout. The request is the path of a script, up to a newline
+[[noreturn]] static void serve_request(Interpreter &interp, int conn) {
+  std::string path;
+  char c;
+  while (read(conn, &c, 1) == 1 && c != '\n') {
+    path.push_back(c);
+  }
+  dup2(conn, STDOUT_FILENO);
+  close(conn);
+  long len;
+  int status = 0;
+  char *content = read_file(path.c_str(), len, status);
+  if (content != nullptr) {
+    auto sc = Scanner(content, len);
+    auto prog = Parser(sc.scan_tokens()).parse();
+    interp.interpret(prog);
+  }
+  // print flushes, but the diagnostics of errors and batch results may not
+  std::cout.flush();
+  fflush(stdout);
+  // Nothing else of the server's is ours to clean up, so no exit()
+  _exit(status);
+}
+
+// The zygote (--serve SOCK): with the prelude already run in "interp", each
+// connection to the Unix socket at "sock_path" gets a fork of this process,
+// which runs the requested script on top of the prelude's state and streams
+// what it prints back. Only returns if the socket can't be set up
+static void serve(Interpreter &interp, const char *sock_path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+    printf("Socket path too long: %s\n", sock_path);
+    return;
+  }
+  strcpy(addr.sun_path, sock_path);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(sock_path);
+  if (sock < 0 || bind(sock, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(sock, SOMAXCONN) != 0) {
+    printf("Could not listen on %s: %s\n", sock_path, strerror(errno));
+    return;
+  }
+  // Children are reaped as soon as they exit
+  signal(SIGCHLD, SIG_IGN);
+  // Or whatever the prelude printed would be printed again by every child
+  std::cout.flush();
+  fflush(stdout);
+  while (true) {
+    int conn = accept(sock, nullptr, nullptr);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      printf("Could not accept on %s: %s\n", sock_path, strerror(errno));
+      break;
+    }
+    pid_t child = fork();
+    if (child == 0) {
+      close(sock);
+      serve_request(interp, conn);
+    }
+    if (child < 0) {
+      std::string why = std::string("Could not fork: ") + strerror(errno) + "\n";
+      (void) write(conn, why.data(), why.size());
+    }
+    close(conn);
+  }
+  close(sock);
+}
+
+static void run_script(char *content, long content_len, const RunOptions &opts) {
+  auto sc = Scanner(content, content_len);
+  auto tokens = sc.scan_tokens();
+  auto parser = Parser(std::move(tokens));
+  auto prog = parser.parse();
+  if (opts.emit_c != nullptr) {
+    emit_c(prog, opts.emit_c);
+    return;
+  }
+  StringTable::max_runtime_len = opts.intern_max;
+  CodeHeap::write_perf_map = opts.perf_map;
+  // Restored functions point into its prelude, so it outlives the interpreter
+  Snapshot snapshot;
+  auto interp = Interpreter{opts.engine};
+  if (opts.jit) {
+    interp.enable_jit(opts.jit_threshold);
+    interp.enable_trace_jit();
+  }
+  if (opts.stack_eval) {
+    interp.enable_stack_eval(opts.max_depth);
+  }
+  if (opts.count_allocs) {
+    if (!AllocCounter::supported()) {
+      printf("--count-allocs needs a build made with -DLOX_COUNT_ALLOCS (make count-allocs)\n");
+      exit(WRONG_USAGE);
+    }
+    interp.enable_alloc_counter();
+  }
+  if (opts.snapshot_in != nullptr) {
+    std::string err;
+    if (!snapshot.restore(opts.snapshot_in, interp, err)) {
+      printf("%s\n", err.c_str());
+      exit(EXIT_FAILURE);
+    }
+  }
+  bool ok = interp.interpret(prog);
+  if (opts.snapshot_out != nullptr) {
+    // A prelude that stopped halfway isn't something to start from
+    if (!ok) {
+      printf("Snapshot not written to %s, the script failed\n", opts.snapshot_out);
+      exit(EXIT_FAILURE);
+    }
+    if (!Snapshot::save(opts.snapshot_out, std::string_view(content, content_len), prog, interp)) {
+      printf("Something went wrong with writing %s\n", opts.snapshot_out);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (ok && opts.batch_fn != nullptr) {
+    run_batch(interp, opts);
+  }
+  if (ok && opts.serve != nullptr) {
+    serve(interp, opts.serve);
+  }
+  if (opts.trace_jit_stats) {
+    if (interp.tracer != nullptr) {
+      interp.tracer->report(std::cerr);
+    } else {
+      std::cerr << "trace-jit: disabled" << std::endl;
+    }
+  }
+  if (opts.spec_stats) {
+    interp.spec_stats.report(std::cerr);
+  }
+}
+
+static void run(char *content, long content_len, const RunOptions &opts) {
+  if (opts.region) {
+    // Everything the run allocated (the program's literals included) is dead
+    // by the time the region goes
+    LoxHeap::Region region;
+    run_script(content, content_len, opts);
+  } else {
+    run_script(content, content_len, opts);
+  }
+  if (opts.gc_stats) {
+    LoxHeap::report(std::cerr);
+  }
+  free(content);
+}
+
+static void run_file(const char *file, const RunOptions &opts) {
+  long len;
+  int status;
+  char *content = read_file(file, len, status);
+  if (content == nullptr) {
+    exit(status);
+  }
+  run(content, len, opts);
 }
 
 int main(int argc, char **argv) {
   Lox compiler;
+  RunOptions opts{};
 
-  if (argc > 2) {
+  if (!parse_args(argc, argv, opts)) {
     print_usage();
     exit(WRONG_USAGE);
-  } else if (argc == 2) {
-    run_file(argv[1]);
+  } else if (opts.script != nullptr) {
+    run_file(opts.script, opts);
   } else {
     run_prompt();
   }
@@ -1,6 +1,44 @@
 #ifndef MAIN_H_
 #define MAIN_H_
 
+#include "Interpreter/interpreter.hpp"
 
+// Everything we can be told on the command line
+struct RunOptions {
+  Engine engine = Engine::ENGINE_TREE;
+  bool jit = true;
+  long jit_threshold = 100;
+  // Register JITed code in /tmp/perf-<pid>.map for "perf", see CodeHeap
+  bool perf_map = false;
+  bool trace_jit_stats = false;
+  bool spec_stats = false;
+  // Runtime strings up to this long are interned (-1: all), see StringTable
+  long intern_max = StringTable::DEFAULT_MAX_RUNTIME_LEN;
+  // Evaluate expressions with an explicit stack, at most max_depth deep
+  bool stack_eval = false;
+  long max_depth = 1000000;
+  // Define the "allocations()" native, see AllocCounter. Only builds made
+  // with -DLOX_COUNT_ALLOCS support it
+  bool count_allocs = false;
+  // Report what the LoxHeap did to stderr, see heap.hpp
+  bool gc_stats = false;
+  // Allocate the whole run from one LoxHeap::Region, freed at once at the end
+  bool region = false;
+  // Set by --emit-c: compile the script to C there instead of running it
+  const char *emit_c = nullptr;
+  // Set by --snapshot-out IMG: save what the script left on its top level to
+  // IMG after running it. Set by --snapshot-in IMG: start the script from
+  // what IMG holds instead. See snapshot.hpp
+  const char *snapshot_out = nullptr;
+  const char *snapshot_in = nullptr;
+  // Set by --serve SOCK: after running the script, run the scripts requested
+  // on the Unix socket SOCK on top of what it left, see serve in main.cpp
+  const char *serve = nullptr;
+  // Set by --batch=NAME --batch-input=FILE: after running the script, call
+  // its function NAME once per row of the CSV file, printing the results
+  const char *batch_fn = nullptr;
+  const char *batch_input = nullptr;
+  const char *script = nullptr;
+};
 
 #endif // MAIN_H_